@@ -1,12 +1,20 @@
 #include "client_discord.h"
+#include "channel.h"
 #include "connection.h"
+#include "http_engine.h"
 #include "logger.h"
+#include "module.h"
 #include "settings.h"
 #include <memory>
 #include <picojson.h>
+#include <random>
 #include <sstream>
+#include <string.h>
+#include <zlib.h>
 
-static const std::string BASE_URL("https://discord.com/api/v9");
+static const std::string BASE_URL("https://discord.com/api/v10");
+static const std::string GATEWAY_URL("wss://gateway.discord.gg");
+static const std::string GATEWAY_PARAMS("/?v=10&encoding=json&compress=zlib-stream");
 
 static void snowflake_analysis(const uint64_t num, time_t *timestamp,
 	uint8_t *worker_id, uint8_t *process_id, uint16_t *increment)
@@ -18,10 +26,119 @@ static void snowflake_analysis(const uint64_t num, time_t *timestamp,
 	*increment = num & 0xFFF;
 }
 
+
+// ============ User ID / Channel ID ============
+
+struct UserIdDiscord : IImplId {
+	UserIdDiscord(cstr_t &id) : user_id(id) {}
+	IImplId *copy(void *parent) const
+	{
+		auto id = new UserIdDiscord(user_id);
+		id->nickptr = &((UserInstance *)parent)->nickname;
+		return id;
+	}
+
+	bool is(const IImplId *other) const
+	{ return user_id == ((UserIdDiscord *)other)->user_id; }
+	size_t hash() const
+	{ return std::hash<std::string>()(user_id); }
+
+	std::string idStr() const { return user_id; }
+	std::string nameStr() const { return *nickptr; }
+
+	std::string user_id; // Snowflake
+	const std::string *nickptr = nullptr;
+};
+
+struct ChannelIdDiscord : IImplId {
+	ChannelIdDiscord(cstr_t &id) : channel_id(id) {}
+
+	IImplId *copy(void *parent) const
+	{ return new ChannelIdDiscord(channel_id); }
+
+	bool is(const IImplId *other) const
+	{ return channel_id == ((ChannelIdDiscord *)other)->channel_id; }
+	size_t hash() const
+	{ return std::hash<std::string>()(channel_id); }
+
+	std::string idStr() const { return channel_id; }
+	std::string nameStr() const { return channel_id; }
+
+	std::string channel_id; // Snowflake
+};
+
+
+// ============ Transport compression ============
+
+// "compress=zlib-stream": all messages are parts of one zlib stream
+struct DiscordInflater {
+	DiscordInflater()
+	{
+		memset(&stream, 0, sizeof(stream));
+		ok = inflateInit(&stream) == Z_OK;
+	}
+	~DiscordInflater()
+	{
+		inflateEnd(&stream);
+	}
+
+	// Returns 'true' once a complete payload is available in "out"
+	bool feed(cstr_t &packet)
+	{
+		static const char SUFFIX[4] = { 0x00, 0x00, (char)0xFF, (char)0xFF };
+
+		const std::string *in = &packet;
+		bool complete = packet.size() >= 4
+			&& memcmp(&packet[packet.size() - 4], SUFFIX, 4) == 0;
+		if (!complete || !pending.empty()) {
+			// Large payloads might be split into several messages
+			pending.append(packet);
+			if (!complete)
+				return false;
+			in = &pending;
+		}
+
+		stream.next_in = (Bytef *)in->data();
+		stream.avail_in = in->size();
+		out.clear();
+
+		do {
+			size_t old_size = out.size();
+			out.resize(old_size + CHUNK_SIZE);
+			stream.next_out = (Bytef *)&out[old_size];
+			stream.avail_out = CHUNK_SIZE;
+
+			int status = inflate(&stream, Z_SYNC_FLUSH);
+			out.resize(old_size + CHUNK_SIZE - stream.avail_out);
+			if (status != Z_OK && status != Z_BUF_ERROR) {
+				WARN("inflate failed: " << status);
+				ok = false;
+				break;
+			}
+		} while (stream.avail_in > 0 || stream.avail_out == 0);
+
+		pending.clear();
+		return ok;
+	}
+
+	static const size_t CHUNK_SIZE = 64 * 1024;
+
+	z_stream stream;
+	bool ok;
+	std::string pending; // Incomplete payload
+	std::string out; // Reused output buffer
+};
+
+
+// ============ Client class ============
+
 ClientDiscord::ClientDiscord(Settings *settings) :
 	IClient(settings)
 {
-	
+	m_token = m_settings->get("discord.token");
+	SettingType::parseS64(m_settings->get("discord.intents"), &m_intents);
+
+	m_reconnect_time = std::chrono::high_resolution_clock::now();
 }
 
 ClientDiscord::~ClientDiscord()
@@ -31,6 +148,10 @@ ClientDiscord::~ClientDiscord()
 void ClientDiscord::initialize()
 {
 	// Authenticate
+	if (m_token.empty()) {
+		ERROR("Setting 'discord.token' is required");
+		return;
+	}
 
 	m_status = DS_CONNECT;
 }
@@ -45,32 +166,10 @@ bool ClientDiscord::run()
 
 	switch (status) {
 		case DS_IDLE: break;
-		case DS_CONNECT: {
-			picojson::object in;
-
-			// https://discord.com/developers/docs/topics/gateway
-			// The server returns status code 403. Why?
-			std::unique_ptr<Connection> con(Connection::createWebsocket(
-					"https://gateway.discord.gg/?v=9&encoding=json"));
-			con->connect();
-
-			picojson::value out;
-			while (true) {
-				sleep_ms(200);
-
-				std::unique_ptr<std::string> contents(con->popRecv());
-				if (!contents)
-					continue;
-
-				LOG(*contents);
-				std::string err = picojson::parse(out, *contents);
-				if (!err.empty()) {
-					WARN("PicoJSON error: " << err);
-					continue;
-				}
-			}
-
-		} break;
+		case DS_CONNECT:
+			if (!connectGateway())
+				m_status = DS_CONNECT; // Retry later
+			break;
 		case DS_OBTAIN_TOKEN: {
 			// 1. Add bot to channel with oauth2 URL
 			// 2. Obtain token
@@ -92,9 +191,271 @@ bool ClientDiscord::run()
 			LOG(out->serialize(true));
 		} break;
 	}
+
+	m_module_mgr->onStep(-1);
+
+	if (m_gateway)
+		processGateway();
 	return true;
 }
 
+float ClientDiscord::getWaitTimeout() const
+{
+	float timeout = IClient::getWaitTimeout();
+	auto time_now = std::chrono::high_resolution_clock::now();
+
+	TimePoint next = m_gateway ? m_next_heartbeat : m_reconnect_time;
+	if (m_gateway && m_heartbeat_interval <= 0)
+		return timeout; // Waiting for Hello
+
+	float delay = std::chrono::duration<float>(next - time_now).count();
+	return std::max(0.0f, std::min(timeout, delay));
+}
+
+bool ClientDiscord::connectGateway()
+{
+	auto time_now = std::chrono::high_resolution_clock::now();
+	if (time_now < m_reconnect_time)
+		return false;
+	m_reconnect_time = time_now + std::chrono::milliseconds((int)(RECONNECT_DELAY * 1000));
+
+	bool resume = !m_session_id.empty() && !m_resume_url.empty();
+	cstr_t &url = resume ? m_resume_url : GATEWAY_URL;
+	LOG("Connecting to " << url << (resume ? " (resume)" : ""));
+
+	m_gateway.reset(Connection::createWebsocket(url + GATEWAY_PARAMS));
+	m_gateway->setWakeEvent(&m_wake);
+	// The zlib context is per connection
+	m_inflater.reset(new DiscordInflater());
+	m_heartbeat_interval = 0;
+	m_heartbeat_acked = true;
+
+	if (!m_gateway->connect()) {
+		m_gateway.reset();
+		return false;
+	}
+	return true;
+}
+
+void ClientDiscord::processGateway()
+{
+	if (!m_gateway->isConnected()) {
+		WARN("Gateway connection lost");
+		m_gateway.reset();
+		m_status = DS_CONNECT;
+		return;
+	}
+
+	while (m_gateway && m_gateway->popRecv(m_packet)) {
+		if (!m_inflater->feed(m_packet)) {
+			if (!m_inflater->ok) {
+				m_gateway.reset();
+				m_status = DS_CONNECT;
+			}
+			continue;
+		}
+
+		picojson::value v;
+		std::string err = picojson::parse(v, m_inflater->out);
+		if (!err.empty() || !v.is<picojson::object>()) {
+			WARN("PicoJSON error: " << err);
+			continue;
+		}
+
+		try {
+			handlePayload(v);
+		} catch (std::runtime_error &e) {
+			ERROR(e.what());
+		}
+	}
+
+	if (!m_gateway)
+		return;
+
+	// After handling the queued packets, which might contain the ACK
+	auto time_now = std::chrono::high_resolution_clock::now();
+	if (m_heartbeat_interval > 0 && time_now >= m_next_heartbeat) {
+		if (!m_heartbeat_acked) {
+			// Zombied connection
+			WARN("No heartbeat ACK. Reconnecting.");
+			m_gateway.reset();
+			m_status = DS_CONNECT;
+			return;
+		}
+		sendHeartbeat();
+	}
+}
+
+void ClientDiscord::handlePayload(picojson::value &v)
+{
+	if (v.get("s").is<int64_t>())
+		m_sequence = v.get("s").get<int64_t>();
+
+	picojson::value &data = v.get("d");
+	switch (v.get("op").get<int64_t>()) {
+		case GW_DISPATCH:
+			handleDispatch(v.get("t").get<std::string>(), data);
+			break;
+		case GW_HEARTBEAT:
+			// Requested by the server
+			sendHeartbeat();
+			break;
+		case GW_RECONNECT:
+			LOG("Reconnect requested");
+			m_gateway.reset();
+			m_status = DS_CONNECT;
+			m_reconnect_time = std::chrono::high_resolution_clock::now();
+			break;
+		case GW_INVALID_SESSION:
+			WARN("Invalid session");
+			if (!data.evaluate_as_boolean()) {
+				// Not resumable. Identify again.
+				m_session_id.clear();
+				m_sequence = -1;
+			}
+			m_gateway.reset();
+			m_status = DS_CONNECT;
+			break;
+		case GW_HELLO: {
+			m_heartbeat_interval = data.get("heartbeat_interval").get<int64_t>() / 1000.0f;
+
+			// First heartbeat after a random fraction of the interval
+			std::mt19937 rng(std::random_device{}());
+			float jitter = std::uniform_real_distribution<float>(0, 1)(rng);
+			m_next_heartbeat = std::chrono::high_resolution_clock::now()
+				+ std::chrono::milliseconds((int)(m_heartbeat_interval * jitter * 1000));
+
+			if (!m_session_id.empty()) {
+				picojson::object d;
+				d["token"] = picojson::value(m_token);
+				d["session_id"] = picojson::value(m_session_id);
+				d["seq"] = picojson::value(m_sequence);
+				sendPayload(GW_RESUME, picojson::value(d));
+			} else {
+				sendIdentify();
+			}
+		} break;
+		case GW_HEARTBEAT_ACK:
+			m_heartbeat_acked = true;
+			break;
+	}
+}
+
+void ClientDiscord::handleDispatch(cstr_t &type, picojson::value &data)
+{
+	if (type == "READY") {
+		m_session_id = data.get("session_id").get<std::string>();
+		m_resume_url = data.get("resume_gateway_url").get<std::string>();
+		m_my_user_id = data.get("user").get("id").get<std::string>();
+		LOG("Logged in as " << data.get("user").get("username").get<std::string>());
+		return;
+	}
+	if (type == "RESUMED") {
+		LOG("Session resumed");
+		return;
+	}
+	if (type != "MESSAGE_CREATE")
+		return;
+
+	picojson::value &author = data.get("author");
+	cstr_t &user_id = author.get("id").get<std::string>();
+	if (user_id == m_my_user_id)
+		return;
+
+	ChannelIdDiscord cid(data.get("channel_id").get<std::string>());
+	Channel *c = m_network->getChannel(cid);
+	if (!c) {
+		// Direct messages have no guild
+		bool is_private = !data.get("guild_id").is<std::string>();
+		c = m_network->addChannel(is_private, cid);
+		if (!is_private)
+			m_module_mgr->onChannelJoin(c);
+	}
+
+	UserInstance *ui = c->getUser(UserIdDiscord(user_id));
+	if (!ui) {
+		ui = c->addUser(UserIdDiscord(user_id));
+		m_module_mgr->onUserJoin(c, ui);
+	}
+	{
+		// Update information
+		m_network->renameUser(ui, author.get("username").get<std::string>());
+		ui->is_bot = author.get("bot").evaluate_as_boolean();
+	}
+
+	std::string msg(data.get("content").get<std::string>());
+	{
+		// Log this line
+		auto &os = g_logger->getStdout(LL_NORMAL);
+		write_timestamp(&os);
+		os << " ";
+		os << ui->nickname << " \t";
+		os << msg << std::endl;
+	}
+
+	m_module_mgr->onUserSay(c, ui, msg);
+}
+
+void ClientDiscord::sendPayload(int op, const picojson::value &data)
+{
+	picojson::object payload;
+	payload["op"] = picojson::value((int64_t)op);
+	payload["d"] = data;
+	m_gateway->send(picojson::value(payload).serialize());
+}
+
+void ClientDiscord::sendHeartbeat()
+{
+	sendPayload(GW_HEARTBEAT, m_sequence < 0 ? picojson::value() : picojson::value(m_sequence));
+	m_heartbeat_acked = false;
+	m_next_heartbeat = std::chrono::high_resolution_clock::now()
+		+ std::chrono::milliseconds((int)(m_heartbeat_interval * 1000));
+}
+
+void ClientDiscord::sendIdentify()
+{
+	picojson::object properties;
+	properties["os"] = picojson::value("linux");
+	properties["browser"] = picojson::value("NyisBotCPP");
+	properties["device"] = picojson::value("NyisBotCPP");
+
+	picojson::object d;
+	d["token"] = picojson::value(m_token);
+	d["intents"] = picojson::value(m_intents);
+	d["properties"] = picojson::value(properties);
+	sendPayload(GW_IDENTIFY, picojson::value(d));
+}
+
+void ClientDiscord::actionSay(Channel *c, cstr_t &text)
+{
+	if (text.empty())
+		return;
+
+	picojson::object in;
+	in["content"] = picojson::value(text);
+
+	Connection *con = Connection::createHTTP("POST", BASE_URL + "/channels/" + c->cid->idStr() + "/messages");
+	con->addHTTP_Header("Content-Type: application/json; charset=UTF-8");
+	con->addHTTP_Header("Authorization: Bot " + m_token);
+	con->enqueueHTTP_Send(picojson::value(in).serialize());
+
+	m_http->enqueue(this, con, [] (Connection *con, bool ok) {
+		long status = ok ? con->getHTTP_Status() : 0;
+		if (status != 200)
+			WARN("Failed to send message. Status: " << status);
+	});
+}
+
+void ClientDiscord::actionReply(Channel *c, UserInstance *ui, cstr_t &text)
+{
+	actionSay(c, "<@" + ui->uid->idStr() + ">: " + text);
+}
+
+void ClientDiscord::actionNotice(Channel *c, UserInstance *ui, cstr_t &text)
+{
+	actionSay(c, "NOTICE : " + text);
+}
+
 void *ClientDiscord::requestREST(cstr_t &method, cstr_t &url, void *post_json)
 {
 	// Testing: https://jsonplaceholder.typicode.com/guide/
@@ -2,9 +2,16 @@
 
 #include "client.h"
 #include "types.h"
+#include <memory> // unique_ptr
 
+class Connection;
 class IModule;
 class Settings;
+struct DiscordInflater;
+
+namespace picojson {
+	class value;
+}
 
 enum DiscordStatus {
 	DS_IDLE,
@@ -22,21 +29,66 @@ public:
 	bool run();
 
 	void sendRaw(cstr_t &text) {}
-	void actionSay(Channel *c, cstr_t &text) {}
-	void actionReply(Channel *c, UserInstance *ui, cstr_t &text) {}
-	void actionNotice(Channel *c, UserInstance *ui, cstr_t &text) {}
+	void actionSay(Channel *c, cstr_t &text);
+	void actionReply(Channel *c, UserInstance *ui, cstr_t &text);
+	void actionNotice(Channel *c, UserInstance *ui, cstr_t &text);
 	void actionJoin(cstr_t &channel) {}
 	void actionLeave(Channel *c) {}
 
 protected:
 	void processRequest(ClientRequest &cr) {}
+	float getWaitTimeout() const;
 	// Creates a new HTTP request
 	// post_json: picojson::object (managed by caller)
 	// return:    picojson::value  (managed by caller)
 	void *requestREST(cstr_t &method, cstr_t &url, void *post_json = nullptr);
 
 private:
+	typedef std::chrono::high_resolution_clock::time_point TimePoint;
+
+	// Gateway
+	bool connectGateway();
+	void processGateway();
+	void handlePayload(picojson::value &v);
+	void handleDispatch(cstr_t &type, picojson::value &data);
+	void sendPayload(int op, const picojson::value &data);
+	void sendHeartbeat();
+	void sendIdentify();
+
+	// Gateway opcodes
+	enum {
+		GW_DISPATCH = 0,
+		GW_HEARTBEAT = 1,
+		GW_IDENTIFY = 2,
+		GW_RESUME = 6,
+		GW_RECONNECT = 7,
+		GW_INVALID_SESSION = 9,
+		GW_HELLO = 10,
+		GW_HEARTBEAT_ACK = 11
+	};
+
+	// GUILDS | GUILD_MESSAGES | DIRECT_MESSAGES | MESSAGE_CONTENT
+	static const int64_t INTENTS_DEFAULT = (1 << 0) | (1 << 9) | (1 << 12) | (1 << 15);
+	static constexpr float RECONNECT_DELAY = 5.0f;
+
 	DiscordStatus m_status = DS_IDLE;
 
 	std::string m_token;
+	int64_t m_intents = INTENTS_DEFAULT;
+	std::string m_my_user_id;
+
+	std::unique_ptr<Connection> m_gateway;
+	std::unique_ptr<DiscordInflater> m_inflater;
+	std::string m_packet; // Reused receive buffer
+	TimePoint m_reconnect_time;
+
+	// Heartbeat
+	float m_heartbeat_interval = 0; // 0: not started yet
+	TimePoint m_next_heartbeat;
+	bool m_heartbeat_acked = true;
+
+	// Session for resuming
+	int64_t m_sequence = -1;
+	std::string m_session_id;
+	std::string m_resume_url;
 };
@@ -4,12 +4,11 @@
 #include "connection.h"
 #include "channel.h"
 #include "iimpl_basic.h"
+#include "irc_message.h"
 #include "logger.h"
 #include "module.h"
 #include "settings.h"
 #include <cstring>
-#include <iostream>
-#include <memory> // unique_ptr
 
 
 // ============ User ID / Channel ID ============
@@ -69,39 +68,99 @@ public:
 // ============ Client class ============
 
 struct ClientActionEntry {
-	size_t offset;
 	const char *status;
-	void (ClientIRC::*handler)(cstr_t &status, NetworkEvent *e);
+	void (ClientIRC::*handler)(const IRCMessage &msg);
 };
 
-struct NetworkEvent {
-	std::string nickname;
-	std::string hostmask;
-	std::string text;
+// Lookup table for s_actions, generated at compile time.
+// Numerics are indexed directly, verbs by a perfect hash.
+struct ClientActionTable {
+	static const size_t NUM_VERB_SLOTS = 64;
+
+	static constexpr bool isNumeric(std::string_view command)
+	{
+		return command.size() == 3
+			&& command[0] >= '0' && command[0] <= '9'
+			&& command[1] >= '0' && command[1] <= '9'
+			&& command[2] >= '0' && command[2] <= '9';
+	}
 
-	std::vector<std::string> args;
+	static constexpr size_t getNumeric(std::string_view command)
+	{
+		return (command[0] - '0') * 100 + (command[1] - '0') * 10 + (command[2] - '0');
+	}
 
-	void dump()
+	// FNV-1a, with the seed picked such that no verbs collide
+	static constexpr size_t getVerbSlot(std::string_view command, uint32_t seed)
 	{
-		std::cout << "\tPacket dump: ";
-		for (const auto &s : args)
-			std::cout << s << " ";
-		std::cout << ": " << text << std::endl;
+		uint32_t hash = 2166136261u ^ seed;
+		for (char c : command)
+			hash = (hash ^ (uint8_t)c) * 16777619u;
+		return hash % NUM_VERB_SLOTS;
 	}
+
+	template <size_t N>
+	constexpr ClientActionTable(const ClientActionEntry (&actions)[N])
+	{
+		static_assert(N < 0xFF, "Too many actions");
+
+		for (seed = 1; seed < 10000; ++seed) {
+			if (tryFill(actions, N))
+				return;
+		}
+		seed = 0; // Failed
+	}
+
+	constexpr bool tryFill(const ClientActionEntry *actions, size_t count)
+	{
+		for (uint8_t &i : numerics)
+			i = 0;
+		for (uint8_t &i : verbs)
+			i = 0;
+
+		for (size_t i = 0; i < count; ++i) {
+			std::string_view command = actions[i].status;
+			uint8_t *slot = isNumeric(command) ?
+				&numerics[getNumeric(command)] : &verbs[getVerbSlot(command, seed)];
+			if (*slot)
+				return false; // Collision or duplicate
+			*slot = i + 1;
+		}
+		return true;
+	}
+
+	// Returns the index + 1 of the entry that might match, or 0
+	size_t find(std::string_view command) const
+	{
+		if (isNumeric(command))
+			return numerics[getNumeric(command)];
+		return verbs[getVerbSlot(command, seed)];
+	}
+
+	uint32_t seed = 0;
+	uint8_t numerics[1000] = {};
+	uint8_t verbs[NUM_VERB_SLOTS] = {};
 };
 
 ClientIRC::ClientIRC(Settings *settings) :
 	IClient(settings)
 {
+	m_send_queue = new IRCSendQueue();
+	// Default until the server announces CASEMAPPING
+	setCaseMapping(CM_RFC1459);
 }
 
 ClientIRC::~ClientIRC()
 {
 	if (m_con && m_auth_status != AS_SEND_NICK) {
-		sendRaw("QUIT :Goodbye");
+		// Bypass the send queue: it is not processed anymore
+		m_con->send("QUIT :Goodbye\n");
 		SLEEP_MS(100);
 	}
 
+	delete m_send_queue;
+	m_send_queue = nullptr;
+
 	delete m_con;
 	m_con = nullptr;
 }
@@ -111,13 +170,27 @@ void ClientIRC::initialize()
 	m_nickname = m_settings->get("irc.nickname");
 	SettingType::parseS64(m_settings->get("irc.authtype"), &m_auth_type);
 
+	{
+		float rate = 0.5f, burst;
+		const char *pos = m_settings->get("irc.send_rate").c_str();
+		SettingType::parseFloat(&pos, &rate);
+		pos = m_settings->get("irc.send_burst").c_str();
+		if (!SettingType::parseFloat(&pos, &burst)) {
+			// Typical ircd flood control allows a backlog of about 10 seconds
+			burst = FLOOD_ALLOWANCE * rate;
+		}
+		m_send_queue->setRate(burst, rate);
+	}
+
 	const std::string &addr = m_settings->get("irc.address");
 	int64_t port = 0;
 	SettingType::parseS64(m_settings->get("irc.port"), &port);
 
 	m_con = Connection::createStream(addr, port);
+	m_con->setWakeEvent(&m_wake);
+	m_con->setLineFilter(&ClientIRC::filterLine);
 	m_con->connect();
-	sendRaw("PING server");
+	sendLine(SP_URGENT, "", "PING server");
 }
 
 void ClientIRC::processRequest(ClientRequest &cr)
@@ -142,24 +215,22 @@ void ClientIRC::processRequest(ClientRequest &cr)
 	}
 }
 
-// TODO: change this to an event queue made from struct { enum, union }
 void ClientIRC::sendRaw(cstr_t &text)
 {
-	MutexLock _(m_send_queue_lock);
-	if (m_send_queue.size() >= SEND_QUEUE_MAX) {
-		ERROR("Queue hard limit reached. Spam flood?");
-
-		while (!m_send_queue.empty())
-			m_send_queue.pop();
-		return;
-	}
+	sendLine(SP_BULK, "", text);
+}
 
-	m_send_queue.push(text + '\n');
+void ClientIRC::sendLine(SendPriority prio, cstr_t &target, cstr_t &text)
+{
+	MutexLock _(m_send_queue_lock);
+	if (m_send_queue->push(prio, target, text + '\n'))
+		m_wake.notify();
 }
 
 void ClientIRC::actionSay(Channel *c, cstr_t &text)
 {
-	sendRaw("PRIVMSG " + c->cid->idStr() + " :" + text);
+	cstr_t &target = c->cid->idStr();
+	sendLine(SP_REPLY, target, "PRIVMSG " + target + " :" + text);
 }
 
 void ClientIRC::actionReply(Channel *c, UserInstance *ui, cstr_t &text)
@@ -170,19 +241,20 @@ void ClientIRC::actionReply(Channel *c, UserInstance *ui, cstr_t &text)
 void ClientIRC::actionNotice(Channel *c, UserInstance *ui, cstr_t &text)
 {
 	// Some IRC clients show this text in a separate tab... :(
-	sendRaw("NOTICE " + ui->uid->idStr() + " :" + text);
+	cstr_t &target = ui->uid->idStr();
+	sendLine(SP_REPLY, target, "NOTICE " + target + " :" + text);
 }
 
 void ClientIRC::actionJoin(cstr_t &channel)
 {
-	sendRaw("JOIN " + channel);
+	sendLine(SP_REPLY, "", "JOIN " + channel);
 }
 
 void ClientIRC::actionLeave(Channel *c)
 {
 	if (c->isPrivate())
 		return;
-	sendRaw("PART " + c->cid->idStr());
+	sendLine(SP_REPLY, "", "PART " + c->cid->idStr());
 }
 
 IFormatter *ClientIRC::createFormatter() const
@@ -190,99 +262,108 @@ IFormatter *ClientIRC::createFormatter() const
 	return new FormatterIRC();
 }
 
+float ClientIRC::getWaitTimeout() const
+{
+	float timeout = IClient::getWaitTimeout();
+
+	MutexLock _(m_send_queue_lock);
+	float delay = m_send_queue->getDelay(std::chrono::high_resolution_clock::now());
+	if (delay >= 0.0f)
+		timeout = std::min(timeout, delay);
+	return timeout;
+}
+
 bool ClientIRC::run()
 {
-	if (!m_con) {
+	if (!m_con || !m_con->isConnected()) {
 		ERROR("Connection died");
 		return false;
 	}
 
 	{
-		// Process send queue
+		// Process send queue as far as the rate limit allows.
+		// getWaitTimeout() ensures to wake up for the remaining lines.
 		MutexLock _(m_send_queue_lock);
-		if (!m_send_queue.empty()) {
-			m_con->send(m_send_queue.front());
-			m_send_queue.pop();
-		}
+		auto time_now = std::chrono::high_resolution_clock::now();
+		std::string line;
+		while (m_send_queue->pop(time_now, &line))
+			m_con->send(line);
 	}
 
 	m_module_mgr->onStep(-1);
 
-	// Process incoming lines, one-by-one
-	std::unique_ptr<std::string> what(m_con->popRecv());
-
-	if (!what)
-		return true;
+	// Take all lines at once, then process them within the time budget
+	if (m_recv_index >= m_recv_lines.size()) {
+		m_recv_lines.clear();
+		m_recv_index = 0;
+		m_con->popRecvBatch(m_recv_lines);
+	}
 
-	g_logger->getFile(LL_NORMAL) << *what << std::endl;
+	auto time_end = std::chrono::high_resolution_clock::now()
+		+ std::chrono::milliseconds(RECV_BUDGET_MS);
 
-	NetworkEvent e;
+	while (m_recv_index < m_recv_lines.size()) {
+		processLine(m_recv_lines[m_recv_index++]);
 
-	// Extract regular text if available. Attention! IPv6 may contain single ':'
-	auto text_pos = what->find(" :");
-	{
-		if (text_pos == std::string::npos)
-			text_pos = what->size();
-		else
-			e.text = what->substr(text_pos + 2);
-	}
+		if (!m_con)
+			break; // ERROR received
 
-	// Split by spaces into "e.args"
-	{
-		size_t pos = 0;
-		while (pos < text_pos) {
-			auto space_pos = what->find(' ', pos);
-			if (space_pos == std::string::npos)
-				space_pos = text_pos;
-			if (space_pos > text_pos)
-				break;
-
-			// Only add non-empty entries
-			if (space_pos > pos)
-				e.args.emplace_back(what->substr(pos, space_pos - pos));
-
-			pos = space_pos + 1;
+		if (std::chrono::high_resolution_clock::now() > time_end) {
+			// Let the send queue and modules run before continuing
+			m_wake.notify();
+			break;
 		}
 	}
 
-	// Find matching action based on status code and index offset
-	const ClientActionEntry *action = s_actions;
-	while (true) {
-		if (e.args.size() > action->offset) {
-			if (e.args[action->offset] == action->status)
-				break; // Found match!
-		}
+	return true;
+}
 
-		// Try next entry
-		action++;
-		if (!action->status) {
-			// last entry reached
-			handleUnknown(*what);
-			return true;
-		}
+bool ClientIRC::filterLine(Connection *con, std::string_view line)
+{
+	// Answer PING right away: the main thread might be busy with modules
+	if (line.find("PING") == std::string_view::npos)
+		return false;
+
+	IRCMessage msg;
+	if (!msg.parse(line) || msg.command != "PING")
+		return false;
+
+	std::string reply("PONG :");
+	reply.append(msg.text());
+	reply.append("\n");
+	con->send(reply);
+
+	// Not passed to processLine(): keep the raw log complete. One write to
+	// keep the two lines together.
+	std::string log_text(line);
+	log_text.append("\n").append(reply);
+	g_logger->getFile(LL_NORMAL) << log_text << std::flush;
+	return true;
+}
+
+void ClientIRC::processLine(cstr_t &what)
+{
+	g_logger->getFile(LL_NORMAL) << what << std::endl;
+
+	IRCMessage msg;
+	if (!msg.parse(what)) {
+		handleUnknown(what);
+		return;
 	}
 
-	if (action->offset == 1) {
-		const std::string &arg = e.args[0];
-		// Format: nickname!hostname status ...
-		auto host_pos = arg.find('!');
-		if (host_pos != std::string::npos) {
-			e.nickname = arg.substr(0, host_pos);
-			e.hostmask = arg.substr(host_pos + 1);
-		} else {
-			e.hostmask = arg;
-		}
+	const ClientActionEntry *action = findAction(msg.command);
+	if (!action) {
+		handleUnknown(what);
+		return;
 	}
 
 	// Run the action if there is any to run
 	if (action->handler)
-		(this->*action->handler)(action->status, &e);
+		(this->*action->handler)(msg);
 
 	// TODO: This is a bad location
 	if (m_auth_status == AS_JOIN_CHANNELS)
 		joinChannels();
-
-	return true;
 }
 
 void ClientIRC::handleUnknown(cstr_t &msg)
@@ -290,21 +371,23 @@ void ClientIRC::handleUnknown(cstr_t &msg)
 	LOG("Unhandled command: " << msg);
 }
 
-void ClientIRC::handleError(cstr_t &status, NetworkEvent *e)
+void ClientIRC::handleError(const IRCMessage &msg)
 {
-	ERROR(e->text);
+	ERROR(msg.text());
 	delete m_con;
 	m_con = nullptr;
 }
 
-void ClientIRC::handleClientEvent(cstr_t &status, NetworkEvent *e)
+void ClientIRC::handleClientEvent(const IRCMessage &msg)
 {
+	std::string_view status = msg.command;
 	VERBOSE("Client event: " << status);
-	//e->dump();
+
+	const std::string nickname(msg.nickname);
 
 	if (status == "JOIN") {
 		// nick!host JOIN :channel
-		ChannelIdIRC cid(e->text);
+		ChannelIdIRC cid((std::string(msg.param(0))));
 		Channel *c = m_network->getChannel(cid);
 		if (!c) {
 			c = m_network->addChannel(false, cid);
@@ -313,16 +396,17 @@ void ClientIRC::handleClientEvent(cstr_t &status, NetworkEvent *e)
 		}
 
 		// Add newly joined user
-		UserInstance *ui = c->addUser(UserIdIRC(e->nickname));
-		((UserIdIRC *)ui->uid)->hostmask = e->hostmask;
+		UserInstance *ui = c->addUser(UserIdIRC(nickname));
+		((UserIdIRC *)ui->uid)->hostmask = msg.hostmask;
 		requestAccStatus(ui);
 
-		if (e->nickname != m_nickname)
+		if (nickname != m_nickname)
 			m_module_mgr->onUserJoin(c, ui);
 	}
 	if (status == "MODE") {
-		cstr_t &what = e->args[2];
-		cstr_t &modes = e->text;
+		// nick!host MODE what :modes
+		const std::string what(msg.param(0));
+		const std::string modes(msg.param(1));
 
 		if (what[0] == '#') {
 			// Channel mode
@@ -342,7 +426,7 @@ void ClientIRC::handleClientEvent(cstr_t &status, NetworkEvent *e)
 			// Our mode updated. Auth, if not already done.
 			if (m_auth_status == AS_AUTHENTICATE) {
 				if (m_auth_type > 0)
-					sendRaw("PRIVMSG NickServ :identify " + m_settings->get("irc.password"));
+					sendLine(SP_URGENT, "NickServ", "PRIVMSG NickServ :identify " + m_settings->get("irc.password"));
 			}
 
 			if (strchr(m_user_modes, 'r'))
@@ -354,24 +438,29 @@ void ClientIRC::handleClientEvent(cstr_t &status, NetworkEvent *e)
 	}
 	if (status == "NICK") {
 		// nick!host NICK :NewNickname
-		UserInstance *ui = m_network->getUser(UserIdIRC(e->nickname));
-		ui->nickname = e->text;
+		UserInstance *ui = m_network->getUser(UserIdIRC(nickname));
+		if (!ui)
+			return;
+
+		m_network->renameUser(ui, std::string(msg.param(0)));
 		requestAccStatus(ui);
 
-		m_module_mgr->onUserRename(ui, e->nickname);
+		m_module_mgr->onUserRename(ui, nickname);
 		return;
 	}
 	if (status == "PART" || status == "KICK") {
 		// nick!host PART channel :reason
-		ChannelIdIRC cid(e->args[2]);
+		// nick!host KICK channel victim :reason
+		ChannelIdIRC cid((std::string(msg.param(0))));
+		const std::string leaving(status == "KICK" ? msg.param(1) : msg.nickname);
 		Channel *c = m_network->getChannel(cid);
-		UserInstance *ui = c->getUser(e->nickname);
+		UserInstance *ui = c ? c->getUser(leaving) : nullptr;
 		if (!c || !ui) {
 			ERROR("Invalid channel or user");
 			return;
 		}
 
-		if (e->nickname == m_nickname) {
+		if (leaving == m_nickname) {
 			m_module_mgr->onChannelLeave(c);
 			m_network->removeChannel(c);
 			return;
@@ -382,7 +471,7 @@ void ClientIRC::handleClientEvent(cstr_t &status, NetworkEvent *e)
 		return;
 	}
 	if (status == "QUIT") {
-		if (e->nickname == m_nickname) {
+		if (nickname == m_nickname) {
 			for (Channel *c : m_network->getAllChannels()) {
 				m_module_mgr->onChannelLeave(c);
 			}
@@ -393,11 +482,14 @@ void ClientIRC::handleClientEvent(cstr_t &status, NetworkEvent *e)
 		}
 
 		// Remove the user from all channels
-		UserInstance *ui = m_network->getUser(e->nickname);
-		for (Channel *c : m_network->getAllChannels()) {
-			if (c->removeUser(ui)) {
-				m_module_mgr->onUserLeave(c, ui);
-			}
+		UserInstance *ui = m_network->getUser(nickname);
+		if (!ui)
+			return;
+
+		std::vector<Channel *> channels(ui->getChannels());
+		for (Channel *c : channels) {
+			c->removeUser(ui);
+			m_module_mgr->onUserLeave(c, ui);
 		}
 		// .. and from the entire network to drop the instance
 		m_network->removeUser(ui);
@@ -405,31 +497,35 @@ void ClientIRC::handleClientEvent(cstr_t &status, NetworkEvent *e)
 		return;
 	}
 	if (status == "INVITE") {
-		sendRaw("JOIN " + e->text);
+		// nick!host INVITE me :channel
+		sendLine(SP_REPLY, "", "JOIN " + std::string(msg.text()));
 		return;
 	}
 }
 
-void ClientIRC::handleChatMessage(cstr_t &status, NetworkEvent *e)
+void ClientIRC::handleChatMessage(const IRCMessage &msg)
 {
+	std::string_view status = msg.command;
+	std::string_view text = msg.text();
+
 	{
 		// Log this line
 		auto &os = g_logger->getStdout(LL_NORMAL);
 		write_timestamp(&os);
 		os << " ";
-		if (!e->nickname.empty() && e->nickname != m_nickname)
-			os << e->nickname << " \t";
+		if (!msg.nickname.empty() && msg.nickname != m_nickname)
+			os << msg.nickname << " \t";
 
-		os << e->text << std::endl;
+		os << text << std::endl;
 	}
 
 	if (status == "NOTICE") {
-		if (e->nickname != "NickServ")
+		if (msg.nickname != "NickServ")
 			return;
 
 		// Retrieve pending user status requests
 		// STATUS username int
-		auto args = strsplit(e->text);
+		auto args = strsplit(std::string(text));
 		if (args.size() != 3)
 			return;
 
@@ -460,37 +556,32 @@ void ClientIRC::handleChatMessage(cstr_t &status, NetworkEvent *e)
 	}
 	if (status == "PRIVMSG") {
 		// nick!host PRIVMSG where :text text
-		cstr_t &channel = e->args[2];
-		if (channel[0] != '#') {
+		std::string_view channel = msg.param(0);
+		if (channel.empty() || channel[0] != '#') {
 			WARN("Private message handling is yet not implemented.");
 			return;
 		}
 
-		ChannelIdIRC cid(channel);
+		ChannelIdIRC cid((std::string(channel)));
 		Channel *c = m_network->getChannel(cid);
 		if (!c) {
 			ERROR("Got PRIVMSG before JOIN:  " << cid.nameStr());
 			c = m_network->addChannel(false, cid);
 		}
 
-		m_module_mgr->onUserSay(c, m_network->getUser(e->nickname), e->text);
+		std::string message(text);
+		m_module_mgr->onUserSay(c, m_network->getUser(std::string(msg.nickname)), message);
 		return;
 	}
 }
 
-void ClientIRC::handlePing(cstr_t &status, NetworkEvent *e)
-{
-	//VERBOSE("PONG!");
-	sendRaw("PONG " + e->text);
-}
-
-void ClientIRC::handleAuthentication(cstr_t &status, NetworkEvent *e)
+void ClientIRC::handleAuthentication(const IRCMessage &msg)
 {
 	if (m_auth_status == AS_SEND_NICK) {
 		LOG("Auth with nick: " << m_nickname);
 
-		sendRaw("USER " + m_nickname + " foo bar :Generic description");
-		sendRaw("NICK " + m_nickname);
+		sendLine(SP_URGENT, "", "USER " + m_nickname + " foo bar :Generic description");
+		sendLine(SP_URGENT, "", "NICK " + m_nickname);
 
 		int64_t type = 0;
 		SettingType::parseS64(m_settings->get("irc.authtype"), &type);
@@ -500,19 +591,39 @@ void ClientIRC::handleAuthentication(cstr_t &status, NetworkEvent *e)
 		m_network->addUser(UserIdIRC(m_nickname));
 		return;
 	}
-	if (status == "396") {
+	if (msg.command == "396") {
 		// Hostmask changed. This indicates successful authentication
 		m_auth_status = AS_JOIN_CHANNELS;
 		return;
 	}
 }
 
-void ClientIRC::handleServerMessage(cstr_t &status, NetworkEvent *e)
+void ClientIRC::handleServerMessage(const IRCMessage &msg)
 {
-	if (status == "353") {
+	if (msg.command == "005") {
+		// RPL_ISUPPORT: me TOKEN=value ... :are supported by this server
+		for (size_t i = 1; i + 1 < msg.num_params; ++i) {
+			std::string_view token = msg.params[i];
+			if (token.substr(0, 12) != "CASEMAPPING=")
+				continue;
+
+			std::string_view value = token.substr(12);
+			if (value == "ascii")
+				setCaseMapping(CM_ASCII);
+			else if (value == "rfc1459")
+				setCaseMapping(CM_RFC1459);
+			else if (value == "strict-rfc1459")
+				setCaseMapping(CM_STRICT_RFC1459);
+			else
+				WARN("Unsupported CASEMAPPING: " << value);
+		}
+		return;
+	}
+	if (msg.command == "353") {
 		// User list
-		ChannelIdIRC cid(e->args[4]);
-		std::vector<std::string> users = strsplit(e->text);
+		// 353 me = #channel :nick1 @nick2
+		ChannelIdIRC cid((std::string(msg.param(2))));
+		std::vector<std::string> users = strsplit(std::string(msg.text()));
 
 		Channel *c = m_network->addChannel(false, cid);
 		for (auto &name : users) {
@@ -538,7 +649,7 @@ void ClientIRC::joinChannels()
 		if (chan.size() < 2 || chan[0] != '#')
 			continue;
 
-		sendRaw("JOIN " + chan);
+		sendLine(SP_REPLY, "", "JOIN " + chan);
 	}
 }
 
@@ -554,47 +665,57 @@ void ClientIRC::requestAccStatus(UserInstance *ui)
 	else
 		text.append("STATUS ");
 
-	sendRaw(text + ui->nickname);
+	sendLine(SP_BULK, "NickServ", text + ui->nickname);
 }
 
-const ClientActionEntry ClientIRC::s_actions[] = {
-	{ 0, "ERROR", &ClientIRC::handleError },
+constexpr ClientActionEntry ClientIRC::s_actions[] = {
+	{ "ERROR", &ClientIRC::handleError },
 // Init messages and auth
-	{ 1, "001", &ClientIRC::handleAuthentication },
-	{ 1, "002", &ClientIRC::handleAuthentication },
-	{ 1, "003", &ClientIRC::handleAuthentication },
-	{ 1, "396", &ClientIRC::handleAuthentication }, // Hostmask changed
-	{ 1, "439", &ClientIRC::handleAuthentication },
-	{ 1, "451", &ClientIRC::handleAuthentication }, // ERR_NOTREGISTERED
+	{ "001", &ClientIRC::handleAuthentication },
+	{ "002", &ClientIRC::handleAuthentication },
+	{ "003", &ClientIRC::handleAuthentication },
+	{ "396", &ClientIRC::handleAuthentication }, // Hostmask changed
+	{ "439", &ClientIRC::handleAuthentication },
+	{ "451", &ClientIRC::handleAuthentication }, // ERR_NOTREGISTERED
 // Server information and events
-	{ 0, "PING", &ClientIRC::handlePing },
-	{ 1, "250", &ClientIRC::handleChatMessage }, // User stats
-	{ 1, "251", &ClientIRC::handleChatMessage }, // RPL_LUSERCLIENT
-	{ 1, "253", &ClientIRC::handleChatMessage }, // RPL_LUSERUNKNOWN
-	{ 1, "255", &ClientIRC::handleChatMessage }, // RPL_LUSERME
-	{ 1, "332", &ClientIRC::handleChatMessage }, // RPL_TOPIC
-	{ 1, "372", &ClientIRC::handleChatMessage }, // RPL_MOTD
-	{ 1, "375", &ClientIRC::handleChatMessage }, // RPL_MOTDSTART
-	{ 1, "376", &ClientIRC::handleChatMessage }, // RPL_ENDOFMOTD
-	{ 1, "353", &ClientIRC::handleServerMessage },  // RPL_NAMREPLY (user list)
-	{ 1, "366", &ClientIRC::handleChatMessage },  // RPL_ENDOFNAMES
+	{ "PING", nullptr }, // Answered by filterLine()
+	{ "250", &ClientIRC::handleChatMessage }, // User stats
+	{ "251", &ClientIRC::handleChatMessage }, // RPL_LUSERCLIENT
+	{ "253", &ClientIRC::handleChatMessage }, // RPL_LUSERUNKNOWN
+	{ "255", &ClientIRC::handleChatMessage }, // RPL_LUSERME
+	{ "332", &ClientIRC::handleChatMessage }, // RPL_TOPIC
+	{ "372", &ClientIRC::handleChatMessage }, // RPL_MOTD
+	{ "375", &ClientIRC::handleChatMessage }, // RPL_MOTDSTART
+	{ "376", &ClientIRC::handleChatMessage }, // RPL_ENDOFMOTD
+	{ "005", &ClientIRC::handleServerMessage },  // RPL_ISUPPORT
+	{ "353", &ClientIRC::handleServerMessage },  // RPL_NAMREPLY (user list)
+	{ "366", &ClientIRC::handleChatMessage },  // RPL_ENDOFNAMES
 // ClientIRC/user events
-	{ 1, "JOIN", &ClientIRC::handleClientEvent },
-	{ 1, "NICK", &ClientIRC::handleClientEvent },
-	{ 1, "KICK", &ClientIRC::handleClientEvent },
-	{ 1, "PART", &ClientIRC::handleClientEvent },
-	{ 0, "QUIT", &ClientIRC::handleClientEvent },
-	{ 1, "MODE",  &ClientIRC::handleClientEvent },
-	{ 1, "PRIVMSG", &ClientIRC::handleChatMessage },
-	{ 1, "NOTICE",  &ClientIRC::handleChatMessage },
-	{ 1, "INVITE", &ClientIRC::handleClientEvent },
+	{ "JOIN", &ClientIRC::handleClientEvent },
+	{ "NICK", &ClientIRC::handleClientEvent },
+	{ "KICK", &ClientIRC::handleClientEvent },
+	{ "PART", &ClientIRC::handleClientEvent },
+	{ "QUIT", &ClientIRC::handleClientEvent },
+	{ "MODE",  &ClientIRC::handleClientEvent },
+	{ "PRIVMSG", &ClientIRC::handleChatMessage },
+	{ "NOTICE",  &ClientIRC::handleChatMessage },
+	{ "INVITE", &ClientIRC::handleClientEvent },
 // Ignore
-	{ 1, "004", nullptr },
-	{ 1, "005", nullptr },
-	{ 1, "252", nullptr },
-	{ 1, "254", nullptr },
-	{ 1, "265", nullptr },
-	{ 1, "266", nullptr },
-	{ 1, "333", nullptr },
-	{ 0, nullptr, nullptr }, // Termination
+	{ "004", nullptr },
+	{ "252", nullptr },
+	{ "254", nullptr },
+	{ "265", nullptr },
+	{ "266", nullptr },
+	{ "333", nullptr },
 };
+
+const ClientActionEntry *ClientIRC::findAction(std::string_view command)
+{
+	static constexpr ClientActionTable table(s_actions);
+	static_assert(table.seed != 0, "Duplicate actions or no perfect hash found");
+
+	size_t index = table.find(command);
+	if (index == 0 || command != s_actions[index - 1].status)
+		return nullptr;
+	return &s_actions[index - 1];
+}
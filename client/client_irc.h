@@ -1,7 +1,9 @@
 #pragma once
 
 #include "client.h"
+#include "irc_sendqueue.h"
 #include "types.h"
+#include <string_view>
 
 class Connection;
 class IFormatter;
@@ -10,7 +12,7 @@ class ModuleMgr;
 class Network;
 class Settings;
 struct ClientActionEntry;
-struct NetworkEvent;
+struct IRCMessage;
 
 class ClientIRC : public IClient {
 public:
@@ -33,21 +35,27 @@ public:
 
 protected:
 	void processRequest(ClientRequest &cr);
+	float getWaitTimeout() const;
 
 private:
+	void sendLine(SendPriority prio, cstr_t &target, cstr_t &text);
+	// Runs in the receive thread
+	static bool filterLine(Connection *con, std::string_view line);
+	void processLine(cstr_t &what);
 	void handleUnknown(cstr_t &msg);
-	void handleError(cstr_t &status, NetworkEvent *e);
-	void handleClientEvent(cstr_t &status, NetworkEvent *e);
-	void handleChatMessage(cstr_t &status, NetworkEvent *e);
-	void handlePing(cstr_t &status, NetworkEvent *e);
-	void handleAuthentication(cstr_t &status, NetworkEvent *e);
-	void handleServerMessage(cstr_t &status, NetworkEvent *e);
+	void handleError(const IRCMessage &msg);
+	void handleClientEvent(const IRCMessage &msg);
+	void handleChatMessage(const IRCMessage &msg);
+	void handleAuthentication(const IRCMessage &msg);
+	void handleServerMessage(const IRCMessage &msg);
 
 	void joinChannels();
 	void requestAccStatus(UserInstance *ui);
 
 	Connection *m_con = nullptr;
+	// Handlers by command. Constant-time lookup with findAction().
 	static const ClientActionEntry s_actions[];
+	static const ClientActionEntry *findAction(std::string_view command);
 
 	enum AuthStatus {
 		AS_SEND_NICK,
@@ -64,7 +72,13 @@ private:
 	// User mode. This should be enough space.
 	char m_user_modes[13] = "            ";
 
-	static const size_t SEND_QUEUE_MAX = 10;
+	// Maximal time to spend on received lines per run() call
+	static const long RECV_BUDGET_MS = 50;
+	std::vector<std::string> m_recv_lines;
+	size_t m_recv_index = 0;
+
+	// Seconds of send backlog tolerated by the server. Sets the default burst.
+	static constexpr float FLOOD_ALLOWANCE = 10.0f;
 	mutable std::mutex m_send_queue_lock;
-	std::queue<std::string> m_send_queue;
+	IRCSendQueue *m_send_queue = nullptr;
 };
@@ -1,6 +1,8 @@
 #include "client_telegram.h"
 #include "channel.h"
 #include "connection.h"
+#include "http_engine.h"
+#include "json_reader.h"
 #include "logger.h"
 #include "module.h"
 #include "settings.h"
@@ -21,6 +23,8 @@ struct UserIdTelegram : IImplId {
 
 	bool is(const IImplId *other) const
 	{ return user_id == ((UserIdTelegram *)other)->user_id; }
+	size_t hash() const
+	{ return std::hash<int64_t>()(user_id); }
 
 	std::string idStr() const
 	{ return std::to_string(user_id); }
@@ -40,6 +44,8 @@ struct ChannelIdTelegram : IImplId {
 
 	bool is(const IImplId *other) const
 	{ return channel_id == ((ChannelIdTelegram *)other)->channel_id; }
+	size_t hash() const
+	{ return std::hash<int64_t>()(channel_id); }
 
 	std::string idStr() const { return std::to_string(channel_id); }
 	std::string nameStr() const { return name; }
@@ -89,9 +95,71 @@ public:
 
 // ============ Client class ============
 
+// Fields of a message update which are used by the client.
+// Decoded without building a JSON tree. Reused for all updates of a batch.
+struct TelegramMessage {
+	void clear()
+	{
+		date = chat_id = from_id = 0;
+		chat_private = has_from = from_is_bot = has_text = false;
+		from_first_name.clear();
+		text.clear();
+	}
+
+	bool read(JsonReader &r)
+	{
+		clear();
+		// Type mismatches are ignored: the members keep their defaults
+		return r.forEachMember([&] (std::string_view key) {
+			if (key == "date") {
+				r.readInt(&date);
+			} else if (key == "text") {
+				has_text = r.readString(&text);
+			} else if (key == "chat") {
+				r.forEachMember([&] (std::string_view key) {
+					if (key == "id") {
+						r.readInt(&chat_id);
+					} else if (key == "type") {
+						std::string type;
+						chat_private = r.readString(&type) && type == "private";
+					} else {
+						r.skipValue();
+					}
+					return !r.hasError();
+				});
+			} else if (key == "from") {
+				has_from = r.forEachMember([&] (std::string_view key) {
+					if (key == "id")
+						r.readInt(&from_id);
+					else if (key == "is_bot")
+						r.readBool(&from_is_bot);
+					else if (key == "first_name")
+						r.readString(&from_first_name);
+					else
+						r.skipValue();
+					return !r.hasError();
+				});
+			} else {
+				r.skipValue();
+			}
+			return !r.hasError();
+		});
+	}
+
+	int64_t date;
+	int64_t chat_id;
+	bool chat_private;
+	bool has_from; // false: channel posts and service messages
+	int64_t from_id;
+	bool from_is_bot;
+	std::string from_first_name;
+	bool has_text; // false: join/leave information
+	std::string text;
+};
+
 struct ClientTelegramActionEntry {
 	const char *type;
-	void (ClientTelegram::*handler)(cstr_t &type, picojson::value &v);
+	void (ClientTelegram::*handler)(const TelegramMessage &msg);
 };
 
 ClientTelegram::ClientTelegram(Settings *settings) :
@@ -99,8 +167,14 @@ ClientTelegram::ClientTelegram(Settings *settings) :
 {
 	m_request_url = "https://api.telegram.org/bot" + settings->get("telegram.token") + "/";
 	SettingType::parseS64(m_settings->get("telegram.cache_update_id"), &m_last_update_id);
-
-	m_last_step = std::chrono::high_resolution_clock::now();
+	SettingType::parseS64(m_settings->get("telegram.poll_timeout"), &m_poll_timeout);
+	SettingType::parseS64(m_settings->get("telegram.poll_limit"), &m_poll_limit);
+	// 0 would return immediately and turn long polling into a request loop
+	m_poll_timeout = std::max<int64_t>(m_poll_timeout, 1);
+	m_poll_limit = std::clamp<int64_t>(m_poll_limit, 1, 100);
+
+	m_poll_next = std::chrono::high_resolution_clock::now();
+	m_send_next = m_poll_next;
 	m_start_time = time(nullptr);
 }
 
@@ -129,7 +203,7 @@ void ClientTelegram::actionSay(Channel *c, cstr_t &text)
 	inp["chat_id"] = picojson::value(c->cid->idStr());
 	inp["text"] = picojson::value(text);
 
-	REQUEST_WRAP(out, "POST", "sendMessage", &inp);
+	enqueueMessage(c, std::move(inp));
 }
 
 void ClientTelegram::actionReply(Channel *c, UserInstance *ui, cstr_t &text)
@@ -144,7 +218,7 @@ void ClientTelegram::actionReply(Channel *c, UserInstance *ui, cstr_t &text)
 	inp["parse_mode"] = picojson::value("MarkdownV2");
 	inp["text"] = picojson::value(fmt->str());
 
-	REQUEST_WRAP(out, "POST", "sendMessage", &inp);
+	enqueueMessage(c, std::move(inp));
 }
 
 void ClientTelegram::actionNotice(Channel *c, UserInstance *ui, cstr_t &text)
@@ -178,67 +252,258 @@ bool ClientTelegram::run()
 {
 	m_module_mgr->onStep(-1);
 
+	if (!m_polling && std::chrono::high_resolution_clock::now() >= m_poll_next)
+		startPolling();
+
+	flushOutbox();
+	return true;
+}
+
+float ClientTelegram::getWaitTimeout() const
+{
+	float timeout = IClient::getWaitTimeout();
 	auto time_now = std::chrono::high_resolution_clock::now();
-	if (std::chrono::duration<float>(time_now - m_last_step).count() < 0.5f)
-		return true;
-	m_last_step = time_now;
+	auto time_until = [&time_now] (TimePoint tp) {
+		return std::chrono::duration<float>(tp - time_now).count();
+	};
+
+	// Retry delay after a failed poll
+	if (!m_polling)
+		timeout = std::min(timeout, time_until(m_poll_next));
+
+	// Rate limited messages
+	for (auto &it : m_outbox) {
+		const OutChat &chat = it.second;
+		if (chat.in_flight || chat.messages.empty())
+			continue;
+
+		float delay = std::max(time_until(chat.next_send), time_until(m_send_next));
+		timeout = std::min(timeout, delay);
+	}
+	return std::max(0.0f, timeout);
+}
 
-	// Polling
+void ClientTelegram::startPolling()
+{
+	// The server holds the request until an update arrives or the timeout expires
 	picojson::object inp;
 	inp["offset"] = picojson::value(m_last_update_id + 1);
+	inp["timeout"] = picojson::value(m_poll_timeout);
+	inp["limit"] = picojson::value(m_poll_limit);
+
+	// Do not download updates which would be ignored
+	picojson::array allowed;
+	for (auto *action = s_actions; action->handler; ++action)
+		allowed.emplace_back(action->type);
+	inp["allowed_updates"] = picojson::value(allowed);
+
+	Connection *con = createRequest("GET", "getUpdates", &inp);
+	// Leave time for the response to arrive
+	con->setHTTP_Timeout((m_poll_timeout + 10) * 1000);
+
+	m_polling = true;
+	m_http->enqueue(this, con, [this] (Connection *con, bool ok) {
+		onPollDone(con, ok);
+	});
+}
 
-	REQUEST_WRAP(out, "GET", "getUpdates", &inp);
-	if (!out)
-		return true;
+void ClientTelegram::onPollDone(Connection *con, bool ok)
+{
+	m_polling = false;
+
+	// The response is a single packet
+	std::string body;
+	if (ok && !con->popRecv(body)) {
+		WARN("Nothing received for getUpdates");
+		ok = false;
+	}
 
+	// { "ok": true, "result": [ { "update_id": 123, "message": { ... } }, ... ] }
+	// Updates are handled while reading. Member order is not guaranteed:
+	// "result" might precede "ok". Duplicates are caught by the update ID.
 	int64_t highest_update_id = m_last_update_id;
-	for (auto &v : out->get<picojson::array>()) {
-		int64_t id = v.get("update_id").get<int64_t>();
-		if (id <= m_last_update_id)
-			continue;
+	bool api_ok = false;
+	TelegramMessage msg;
+	JsonReader reader(body);
+
+	ok = ok && reader.forEachMember([&] (std::string_view key) {
+		if (key == "ok")
+			return reader.readBool(&api_ok);
+		if (key == "result") {
+			return reader.forEachElement([&] () {
+				return processUpdate(reader, &msg, &highest_update_id);
+			});
+		}
+		return reader.skipValue();
+	});
+
+	if (highest_update_id != m_last_update_id) {
+		m_last_update_id = highest_update_id;
+		m_settings->set("telegram.cache_update_id", std::to_string(m_last_update_id));
+	}
 
-		highest_update_id = std::max(highest_update_id, id);
+	if (!ok || !api_ok) {
+		if (!body.empty())
+			WARN("getUpdates failed: " << body.substr(0, 500));
 
-		// Handle events
-		processUpdate(v);
+		// Do not hammer the API on network or server errors
+		m_poll_next = std::chrono::high_resolution_clock::now()
+			+ std::chrono::milliseconds((int)(POLL_RETRY_DELAY * 1000));
+		return;
 	}
 
-	m_last_update_id = highest_update_id;
-	m_settings->set("telegram.cache_update_id", std::to_string(m_last_update_id));
+	// Poll again immediately
+	startPolling();
+}
 
-	return true;
+void ClientTelegram::enqueueMessage(Channel *c, picojson::object && inp)
+{
+	OutChat &chat = m_outbox[c->cid->idStr()];
+	chat.interval = c->isPrivate() ? SEND_INTERVAL_PRIVATE : SEND_INTERVAL_GROUP;
+
+	if (chat.messages.size() >= SEND_QUEUE_MAX) {
+		WARN("Send queue full for chat " << c->cid->idStr() << ". Dropping oldest message");
+		// The first message might be in transfer
+		chat.messages.erase(chat.messages.begin() + (chat.in_flight ? 1 : 0));
+	}
+	chat.messages.emplace_back(std::move(inp));
+
+	flushOutbox();
 }
 
-void ClientTelegram::processUpdate(picojson::value &update)
+void ClientTelegram::flushOutbox()
 {
-	// Find matching action based on status code and index offset
-	const ClientTelegramActionEntry *action = s_actions;
-	picojson::value *v = nullptr;
-	for (auto *action = s_actions; action->handler; ++action) {
-		v = &update.get(action->type);
-		if (v->is<picojson::object>()) {
-			// Good!
-			break;
+	auto time_now = std::chrono::high_resolution_clock::now();
+	const auto global_interval = std::chrono::microseconds((int)(1E6f / SEND_RATE_GLOBAL));
+
+	for (auto it = m_outbox.begin(); it != m_outbox.end();) {
+		OutChat &chat = it->second;
+		if (!chat.in_flight && chat.messages.empty()) {
+			it = m_outbox.erase(it);
+			continue;
 		}
+
+		if (chat.in_flight || time_now < chat.next_send || time_now < m_send_next) {
+			++it;
+			continue;
+		}
+
+		// The message is removed once it was delivered
+		Connection *con = createRequest("POST", "sendMessage", &chat.messages.front());
+		chat.in_flight = true;
+		m_send_next = time_now + global_interval;
+
+		std::string chat_id = it->first;
+		m_http->enqueue(this, con, [this, chat_id] (Connection *con, bool ok) {
+			onSendDone(chat_id, con, ok);
+		});
+		++it;
 	}
+}
 
-	if (!action->handler) {
-		handleUnknown(update);
+void ClientTelegram::onSendDone(cstr_t &chat_id, Connection *con, bool ok)
+{
+	auto it = m_outbox.find(chat_id);
+	if (it == m_outbox.end())
 		return;
+
+	OutChat &chat = it->second;
+	chat.in_flight = false;
+
+	auto time_now = std::chrono::high_resolution_clock::now();
+	auto delay = [] (float seconds) {
+		return std::chrono::milliseconds((int)(seconds * 1000));
+	};
+
+	picojson::value json;
+	std::unique_ptr<std::string> contents(ok ? con->popAll() : nullptr);
+	if (contents)
+		picojson::parse(json, *contents);
+
+	bool answered = json.is<picojson::object>();
+	bool delivered = answered && json.get("ok").evaluate_as_boolean();
+
+	// Flood control: "parameters": { "retry_after": seconds }
+	int64_t retry_after = -1;
+	if (answered && json.get("parameters").is<picojson::object>()) {
+		picojson::value &v = json.get("parameters").get("retry_after");
+		if (v.is<int64_t>())
+			retry_after = v.get<int64_t>();
 	}
 
+	if (answered && retry_after < 0) {
+		if (!delivered)
+			WARN("sendMessage failed: " << json.serialize(false));
+
+		// Done or rejected by the API
+		chat.messages.pop_front();
+		chat.retries = 0;
+		chat.next_send = time_now + delay(chat.interval);
+	} else if (answered) {
+		WARN("Rate limited in chat " << chat_id << ". Retrying in " << retry_after << "s");
+		chat.next_send = time_now + delay(retry_after);
+	} else if (++chat.retries >= SEND_MAX_RETRIES) {
+		WARN("Cannot deliver message to chat " << chat_id << ". Dropping it");
+		chat.messages.pop_front();
+		chat.retries = 0;
+		chat.next_send = time_now + delay(chat.interval);
+	} else {
+		// Network error
+		chat.next_send = time_now + delay(POLL_RETRY_DELAY);
+	}
+
+	flushOutbox();
+}
+
+bool ClientTelegram::processUpdate(JsonReader &reader, TelegramMessage *msg, int64_t *highest_id)
+{
+	int64_t id = -1;
+	const ClientTelegramActionEntry *action = nullptr;
+
+	bool ok = reader.forEachMember([&] (std::string_view key) {
+		if (key == "update_id")
+			return reader.readInt(&id);
+
+		for (auto *it = s_actions; it->handler; ++it) {
+			if (key == it->type) {
+				action = it;
+				return msg->read(reader);
+			}
+		}
+
+		LOG("Unhandled update type: " << key);
+		return reader.skipValue();
+	});
+
+	if (!ok || id <= m_last_update_id)
+		return ok;
+
+	*highest_id = std::max(*highest_id, id);
+	if (!action)
+		return true;
+
 	try {
-		(this->*action->handler)(action->type, *v);
+		(this->*action->handler)(*msg);
 	} catch (std::runtime_error &e) {
-		ERROR(e.what() << "\n" << v->serialize(false));
+		ERROR(e.what());
 	}
+	return true;
 }
 
 picojson::value *ClientTelegram::requestREST(cstr_t &method, cstr_t &url, picojson::object *post_json)
 {
 	// Testing: https://jsonplaceholder.typicode.com/guide/
 
-	std::unique_ptr<Connection> con(Connection::createHTTP(method, m_request_url + url));
+	std::unique_ptr<Connection> con(createRequest(method, url, post_json));
+	if (!con->connect())
+		return nullptr; // Timeout?
+
+	return parseResponse(con.get(), url);
+}
+
+Connection *ClientTelegram::createRequest(cstr_t &method, cstr_t &url, picojson::object *post_json)
+{
+	Connection *con = Connection::createHTTP(method, m_request_url + url);
 	// Connection: Send
 	if (post_json)
 		con->addHTTP_Header("Content-Type: application/json; charset=UTF-8");
@@ -250,9 +515,11 @@ picojson::value *ClientTelegram::requestREST(cstr_t &method, cstr_t &url, picojs
 	if (post_json) {
 		con->enqueueHTTP_Send(picojson::value(*post_json).serialize());
 	}
-	if (!con->connect())
-		return nullptr; // Timeout?
+	return con;
+}
 
+picojson::value *ClientTelegram::parseResponse(Connection *con, cstr_t &url)
+{
 	// Connection: Receive
 	std::unique_ptr<picojson::value> json(new picojson::value());
 	std::unique_ptr<std::string> contents(con->popAll());
@@ -309,43 +576,35 @@ const ClientTelegramActionEntry ClientTelegram::s_actions[] = {
 	{ nullptr, nullptr }
 };
 
-void ClientTelegram::handleUnknown(picojson::value &v)
-{
-	LOG("Unhandled: " << v.serialize(true));
-}
-
-void ClientTelegram::handleMessage(cstr_t &type, picojson::value &v)
+void ClientTelegram::handleMessage(const TelegramMessage &m)
 {
-	if (!v.get("text").is<std::string>())
+	if (!m.has_text)
 		return; // Join/leave information
-	if (v.get("date").get<int64_t>() < m_start_time) {
+	if (m.date < m_start_time) {
 		WARN("Outdated last ID! Ignoring.");
 		return;
 	}
-	picojson::value &v_from = v.get("from");
-	if (!v_from.is<picojson::object>())
+	if (!m.has_from)
 		return; // Global infomation/notices
 
-	ChannelIdTelegram cid(v.get("chat").get("id").get<int64_t>());
-	bool is_private = v.get("chat").get("type").get<std::string>() == "private";
-	Channel *c = joinChannelIfNeeded(is_private, &cid);
+	ChannelIdTelegram cid(m.chat_id);
+	Channel *c = joinChannelIfNeeded(m.chat_private, &cid);
 
-	int64_t user_id = v_from.get("id").get<int64_t>();
-	if (user_id == m_my_user_id)
+	if (m.from_id == m_my_user_id)
 		return;
 
-	UserInstance *ui = c->getUser(UserIdTelegram(user_id));
+	UserInstance *ui = c->getUser(UserIdTelegram(m.from_id));
 	if (!ui) {
-		ui = c->addUser(UserIdTelegram(user_id));
+		ui = c->addUser(UserIdTelegram(m.from_id));
 		m_module_mgr->onUserJoin(c, ui);
 	}
 	{
 		// Update information
-		ui->nickname = v_from.get("first_name").get<std::string>();
-		ui->is_bot = v_from.get("is_bot").evaluate_as_boolean();
+		m_network->renameUser(ui, m.from_first_name);
+		ui->is_bot = m.from_is_bot;
 	}
 
-	std::string msg(v.get("text").get<std::string>());
+	std::string msg(m.text);
 
 	{
 		// Log this line
@@ -3,13 +3,17 @@
 #include "client.h"
 #include "types.h"
 #include <picojson.h>
+#include <deque>
 #include <map>
 
+class Connection;
 class IModule;
 class Settings;
 struct ClientTelegramActionEntry;
 struct ClientTelegramUserData;
 struct IImplId;
+struct TelegramMessage;
+class JsonReader;
 
 class ClientTelegram : public IClient {
 public:
@@ -32,22 +36,60 @@ public:
 
 protected:
 	void processRequest(ClientRequest &cr) {}
+	float getWaitTimeout() const;
 
 private:
 	// Creates a new HTTP request
 	// post_json: managed by caller
 	// return:    managed by caller
 	picojson::value *requestREST(cstr_t &method, cstr_t &url, picojson::object *post_json = nullptr);
+	Connection *createRequest(cstr_t &method, cstr_t &url, picojson::object *post_json);
+	picojson::value *parseResponse(Connection *con, cstr_t &url);
+	void startPolling();
+	void onPollDone(Connection *con, bool ok);
+
+	// Outgoing messages
+	void enqueueMessage(Channel *c, picojson::object && inp);
+	void flushOutbox();
+	void onSendDone(cstr_t &chat_id, Connection *con, bool ok);
 	Channel *joinChannelIfNeeded(bool is_private, IImplId *cid);
 	ClientTelegramUserData *getUserDataOrCreate(UserInstance *ui);
 
 	static const ClientTelegramActionEntry s_actions[];
 
-	void processUpdate(picojson::value &update);
-	void handleUnknown(picojson::value &v);
-	void handleMessage(cstr_t &type, picojson::value &v);
+	bool processUpdate(JsonReader &reader, TelegramMessage *msg, int64_t *highest_id);
+	void handleMessage(const TelegramMessage &msg);
+
+	// Long polling: server-side timeout in seconds
+	static const int POLL_TIMEOUT_DEFAULT = 50;
+	static const int POLL_LIMIT_DEFAULT = 100;
+	// Delay after failed requests
+	static constexpr float POLL_RETRY_DELAY = 5.0f;
+
+	// Bot API limits: messages per second and seconds between messages per chat
+	static constexpr float SEND_RATE_GLOBAL = 30.0f;
+	static constexpr float SEND_INTERVAL_PRIVATE = 1.0f;
+	static constexpr float SEND_INTERVAL_GROUP = 3.0f;
+	static const size_t SEND_QUEUE_MAX = 100;
+	static const int SEND_MAX_RETRIES = 3;
+
+	typedef std::chrono::high_resolution_clock::time_point TimePoint;
+
+	// Messages of one chat are sent one after another
+	struct OutChat {
+		std::deque<picojson::object> messages;
+		TimePoint next_send;
+		float interval;
+		bool in_flight = false;
+		int retries = 0;
+	};
+	std::map<std::string, OutChat> m_outbox; // key: chat ID
+	TimePoint m_send_next;
 
-	std::chrono::high_resolution_clock::time_point m_last_step;
+	TimePoint m_poll_next;
+	bool m_polling = false;
+	int64_t m_poll_timeout = POLL_TIMEOUT_DEFAULT;
+	int64_t m_poll_limit = POLL_LIMIT_DEFAULT;
 	time_t m_start_time;
 	int64_t m_my_user_id = 0;
 	int64_t m_last_update_id = 0;
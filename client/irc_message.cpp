@@ -0,0 +1,83 @@
+#include "irc_message.h"
+
+// Returns the next space-separated word and skips the following spaces
+static std::string_view next_word(std::string_view &line)
+{
+	size_t end = line.find(' ');
+	std::string_view word = line.substr(0, end);
+
+	if (end == std::string_view::npos)
+		end = line.size();
+	while (end < line.size() && line[end] == ' ')
+		end++;
+	line.remove_prefix(end);
+	return word;
+}
+
+bool IRCMessage::parse(std::string_view line)
+{
+	tags = prefix = nickname = hostmask = command = std::string_view();
+	num_params = 0;
+
+	while (!line.empty() && (line.back() == '\r' || line.back() == '\n'))
+		line.remove_suffix(1);
+	while (!line.empty() && line[0] == ' ')
+		line.remove_prefix(1);
+
+	if (!line.empty() && line[0] == '@') {
+		line.remove_prefix(1);
+		tags = next_word(line);
+	}
+
+	if (!line.empty() && line[0] == ':') {
+		line.remove_prefix(1);
+		prefix = next_word(line);
+
+		// Format: nickname!user@host
+		size_t host_pos = prefix.find('!');
+		if (host_pos != std::string_view::npos) {
+			nickname = prefix.substr(0, host_pos);
+			hostmask = prefix.substr(host_pos + 1);
+		} else {
+			hostmask = prefix;
+		}
+	}
+
+	command = next_word(line);
+	if (command.empty())
+		return false;
+
+	while (!line.empty() && num_params < MAX_PARAMS) {
+		if (line[0] == ':' || num_params == MAX_PARAMS - 1) {
+			// Trailing parameter: may contain spaces
+			if (line[0] == ':')
+				line.remove_prefix(1);
+			params[num_params++] = line;
+			break;
+		}
+
+		params[num_params++] = next_word(line);
+	}
+	return true;
+}
+
+bool IRCMessage::getTag(std::string_view key, std::string_view *value) const
+{
+	std::string_view list = tags;
+	while (!list.empty()) {
+		size_t end = list.find(';');
+		std::string_view tag = list.substr(0, end);
+		list.remove_prefix(end == std::string_view::npos ? list.size() : end + 1);
+
+		size_t eq_pos = tag.find('=');
+		if (tag.substr(0, eq_pos) != key)
+			continue;
+
+		if (value) {
+			*value = eq_pos == std::string_view::npos ?
+				std::string_view() : tag.substr(eq_pos + 1);
+		}
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string_view>
+
+// Parsed IRC line (RFC 1459 with IRCv3 message tags)
+// All fields are views into the parsed line, which must outlive this object.
+// Format: [@tags] [:prefix] command [params ...] [:trailing]
+
+struct IRCMessage {
+	// RFC 2812: 14 middle parameters plus the trailing one
+	static const size_t MAX_PARAMS = 15;
+
+	bool parse(std::string_view line);
+
+	// Value of the tag "key" as sent (escaped), empty if it has none
+	bool getTag(std::string_view key, std::string_view *value = nullptr) const;
+
+	// Returns an empty view if out of range
+	std::string_view param(size_t i) const
+	{ return i < num_params ? params[i] : std::string_view(); }
+	// Last parameter, which is usually the text
+	std::string_view text() const
+	{ return num_params > 0 ? params[num_params - 1] : std::string_view(); }
+
+	std::string_view tags;     // Without '@'
+	std::string_view prefix;   // Without ':'
+	std::string_view nickname; // Prefix part before '!'. Empty for servers.
+	std::string_view hostmask; // Prefix part after '!', or the server name
+	std::string_view command;
+
+	std::string_view params[MAX_PARAMS];
+	size_t num_params = 0;
+};
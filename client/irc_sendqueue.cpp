@@ -0,0 +1,141 @@
+#include "irc_sendqueue.h"
+#include "logger.h"
+
+IRCSendQueue::IRCSendQueue() :
+	m_lanes {
+		// max_lines, max_per_target, drop_oldest
+		{ 100, 100, false }, // SP_URGENT
+		{ 200,  30, false }, // SP_REPLY
+		{ 100,  50, true  }, // SP_BULK
+	}
+{
+	m_last_refill = std::chrono::high_resolution_clock::now();
+}
+
+void IRCSendQueue::setRate(float burst, float rate)
+{
+	m_burst = std::max(1.0f, burst);
+	m_rate = std::max(0.01f, rate);
+	m_tokens = std::min(m_tokens, m_burst);
+}
+
+bool IRCSendQueue::push(SendPriority prio, cstr_t &target, std::string &&line)
+{
+	Lane &lane = m_lanes[prio];
+	auto [it, is_new] = lane.targets.insert({target, {}});
+	auto &lines = it->second;
+
+	if (lane.count >= lane.max_lines || lines.size() >= lane.max_per_target) {
+		if (!lane.drop_oldest || lines.empty()) {
+			ERROR("Queue limit reached for '" << target << "'. Spam flood?");
+			if (is_new)
+				lane.targets.erase(it);
+			return false;
+		}
+
+		VERBOSE("Dropping oldest line for '" << target << "'");
+		lines.pop_front();
+		lane.count--;
+	}
+
+	if (lines.empty())
+		lane.order.push_back(target);
+
+	lines.push_back(std::move(line));
+	lane.count++;
+	return true;
+}
+
+void IRCSendQueue::refill(TimePoint now)
+{
+	float dtime = std::chrono::duration<float>(now - m_last_refill).count();
+	if (dtime <= 0.0f)
+		return;
+
+	m_tokens = std::min(m_burst, m_tokens + dtime * m_rate);
+	m_last_refill = now;
+}
+
+const std::string *IRCSendQueue::peek() const
+{
+	for (const Lane &lane : m_lanes) {
+		if (lane.count == 0)
+			continue;
+
+		return &lane.targets.find(lane.order.front())->second.front();
+	}
+	return nullptr;
+}
+
+float IRCSendQueue::getCost(const std::string &line) const
+{
+	// Never more than the bucket holds: long lines must not get stuck
+	return std::min(m_burst, 1.0f + (float)(line.size() / BYTES_PER_TOKEN));
+}
+
+bool IRCSendQueue::pop(TimePoint now, std::string *line)
+{
+	refill(now);
+	const std::string *next = peek();
+	if (!next)
+		return false;
+
+	const float cost = getCost(*next);
+	if (m_tokens < cost)
+		return false;
+
+	for (Lane &lane : m_lanes) {
+		if (lane.count == 0)
+			continue;
+
+		// Next target in turn
+		auto it = lane.targets.find(lane.order.front());
+		lane.order.pop_front();
+
+		auto &lines = it->second;
+		*line = std::move(lines.front());
+		lines.pop_front();
+		lane.count--;
+
+		if (lines.empty())
+			lane.targets.erase(it);
+		else
+			lane.order.push_back(it->first);
+
+		m_tokens -= cost;
+		return true;
+	}
+	return false;
+}
+
+float IRCSendQueue::getDelay(TimePoint now) const
+{
+	const std::string *next = peek();
+	if (!next)
+		return -1.0f;
+
+	const float cost = getCost(*next);
+	float dtime = std::chrono::duration<float>(now - m_last_refill).count();
+	float tokens = std::min(m_burst, m_tokens + std::max(0.0f, dtime) * m_rate);
+	if (tokens >= cost)
+		return 0.0f;
+
+	return (cost - tokens) / m_rate;
+}
+
+size_t IRCSendQueue::size() const
+{
+	size_t count = 0;
+	for (const Lane &lane : m_lanes)
+		count += lane.count;
+	return count;
+}
+
+void IRCSendQueue::clear()
+{
+	for (Lane &lane : m_lanes) {
+		lane.count = 0;
+		lane.targets.clear();
+		lane.order.clear();
+	}
+}
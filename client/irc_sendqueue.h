@@ -0,0 +1,64 @@
+#pragma once
+
+#include "types.h"
+#include <chrono>
+#include <deque>
+#include <map>
+
+enum SendPriority {
+	SP_URGENT, // PONG, authentication
+	SP_REPLY,  // Responses to users
+	SP_BULK,   // Everything else
+	SP_MAX
+};
+
+// Rate-limited output queue with priority lanes.
+// Within a lane, the targets (channels, users) take turns.
+
+class IRCSendQueue {
+public:
+	typedef std::chrono::high_resolution_clock::time_point TimePoint;
+
+	IRCSendQueue();
+	DISABLE_COPY(IRCSendQueue);
+
+	// Token bucket: "burst" tokens at once, then "rate" tokens per second.
+	// Like ircu, a line costs one token plus one per BYTES_PER_TOKEN bytes.
+	void setRate(float burst, float rate);
+
+	bool push(SendPriority prio, cstr_t &target, std::string &&line);
+	// Returns the next line that may be sent at "now"
+	bool pop(TimePoint now, std::string *line);
+	// Seconds until the next line may be sent. Negative if empty.
+	float getDelay(TimePoint now) const;
+
+	size_t size() const;
+	void clear();
+
+private:
+	struct Lane {
+		const size_t max_lines;
+		const size_t max_per_target;
+		// Whether to drop the oldest line (true) or reject the new one (false)
+		const bool drop_oldest;
+
+		size_t count = 0;
+		std::map<std::string, std::deque<std::string>> targets;
+		// Round-robin order of the targets with pending lines
+		std::deque<std::string> order;
+	};
+
+	void refill(TimePoint now);
+	// Line to pop next, or nullptr
+	const std::string *peek() const;
+	float getCost(const std::string &line) const;
+
+	static const size_t BYTES_PER_TOKEN = 120;
+
+	Lane m_lanes[SP_MAX];
+
+	float m_burst = 5;
+	float m_rate = 0.5f;
+	float m_tokens = 5;
+	TimePoint m_last_refill;
+};
@@ -2,6 +2,7 @@
 #include "client.h"
 #include "logger.h"
 #include "settings.h"
+#include <algorithm> // std::find
 
 
 // ================= UserInstance =================
@@ -12,6 +13,16 @@ UserInstance::UserInstance(const IImplId &uid)
 	this->uid = uid.copy(this);
 }
 
+void UserInstance::removeChannel(Channel *c)
+{
+	// Order does not matter
+	auto it = std::find(m_channels.begin(), m_channels.end(), c);
+	if (it != m_channels.end()) {
+		*it = m_channels.back();
+		m_channels.pop_back();
+	}
+}
+
 
 // ================= IUserOwner =================
 
@@ -29,6 +40,8 @@ IUserOwner::~IUserOwner()
 		ui->dropRef();
 
 	m_users.clear();
+	m_user_index.clear();
+	m_name_index.clear();
 }
 
 UserInstance *IUserOwner::addUser(const IImplId &uid)
@@ -45,17 +58,18 @@ UserInstance *IUserOwner::addUser(const IImplId &uid)
 	}
 
 	// std::set has unique keys
-	m_users.insert(ui);
+	if (m_users.insert(ui).second) {
+		indexUser(ui);
+		if (this != m_client->getNetwork())
+			ui->m_channels.push_back((Channel *)this);
+	}
 	return ui;
 }
 
 UserInstance *IUserOwner::getUser(const IImplId &uid) const
 {
-	for (UserInstance *ui : m_users) {
-		if (uid.is(ui->uid))
-			return ui;
-	}
-	return nullptr;
+	auto it = m_user_index.find(&uid);
+	return it != m_user_index.end() ? it->second : nullptr;
 }
 
 UserInstance *IUserOwner::getUser(cstr_t &name) const
@@ -63,6 +77,31 @@ UserInstance *IUserOwner::getUser(cstr_t &name) const
 	return m_client->findUser(this, name);
 }
 
+UserInstance *IUserOwner::getUserByFoldedName(cstr_t &name) const
+{
+	auto it = m_name_index.find(name);
+	return it != m_name_index.end() ? it->second : nullptr;
+}
+
+void IUserOwner::indexUser(UserInstance *ui)
+{
+	m_user_index.emplace(ui->uid, ui);
+	m_name_index.emplace(casefold(ui->nickname, m_client->getCaseMapping()), ui);
+}
+
+void IUserOwner::unindexUser(UserInstance *ui)
+{
+	m_user_index.erase(ui->uid);
+
+	auto range = m_name_index.equal_range(casefold(ui->nickname, m_client->getCaseMapping()));
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == ui) {
+			m_name_index.erase(it);
+			break;
+		}
+	}
+}
+
 bool IUserOwner::removeUser(UserInstance *ui)
 {
 	auto it = m_users.find(ui);
@@ -72,10 +111,13 @@ bool IUserOwner::removeUser(UserInstance *ui)
 	// Remove from all channels before network itself
 	Network *net = m_client->getNetwork();
 	if (this == net) {
-		for (Channel *c : net->getAllChannels())
-			c->removeUser(ui);
+		while (!ui->m_channels.empty())
+			ui->m_channels.back()->removeUser(ui);
+	} else {
+		ui->removeChannel((Channel *)this);
 	}
 
+	unindexUser(ui);
 	ui->dropRef();
 	m_users.erase(it);
 	return true;
@@ -115,9 +157,13 @@ Channel::~Channel()
 	delete m_containers;
 	m_containers = nullptr;
 
-	for (UserInstance *ui : m_users)
+	for (UserInstance *ui : m_users) {
+		ui->removeChannel(this);
 		ui->dropRef();
+	}
 	m_users.clear();
+	m_user_index.clear();
+	m_name_index.clear();
 
 	delete cid;
 	cid = nullptr;
@@ -148,6 +194,7 @@ void Channel::leave()
 
 Network::~Network()
 {
+	m_channel_index.clear();
 	for (Channel *c : m_channels)
 		delete c;
 	m_channels.clear();
@@ -155,6 +202,8 @@ Network::~Network()
 	for (UserInstance *ui : m_users)
 		delete ui;
 	m_users.clear();
+	m_user_index.clear();
+	m_name_index.clear();
 }
 
 Channel *Network::addChannel(bool is_private, const IImplId &cid)
@@ -163,17 +212,15 @@ Channel *Network::addChannel(bool is_private, const IImplId &cid)
 	if (!c) {
 		c = new Channel(is_private, cid, m_client);
 		m_channels.insert(c);
+		m_channel_index.emplace(c->cid, c);
 	}
 	return c;
 }
 
 Channel *Network::getChannel(const IImplId &cid) const
 {
-	for (Channel *it : m_channels) {
-		if (it->cid->is(&cid))
-			return it;
-	}
-	return nullptr;
+	auto it = m_channel_index.find(&cid);
+	return it != m_channel_index.end() ? it->second : nullptr;
 }
 
 bool Network::removeChannel(Channel *c)
@@ -184,6 +231,7 @@ bool Network::removeChannel(Channel *c)
 
 	std::set<UserInstance *> ui_copy = c->getAllUsers();
 
+	m_channel_index.erase(c->cid);
 	delete c;
 	m_channels.erase(it);
 
@@ -200,3 +248,35 @@ bool Network::contains(Channel *c) const
 {
 	return m_channels.find(c) != m_channels.end();
 }
+
+void Network::renameUser(UserInstance *ui, cstr_t &nickname)
+{
+	if (ui->nickname == nickname)
+		return;
+
+	// The keys change: remove from the indices first
+	std::vector<IUserOwner *> owners(ui->getChannels().begin(), ui->getChannels().end());
+	if (IUserOwner::contains(ui))
+		owners.push_back(this);
+
+	for (IUserOwner *owner : owners)
+		owner->unindexUser(ui);
+
+	ui->nickname = nickname;
+
+	for (IUserOwner *owner : owners)
+		owner->indexUser(ui);
+}
+
+void Network::rebuildNameIndex()
+{
+	auto rebuild = [this] (IUserOwner *owner) {
+		owner->m_name_index.clear();
+		for (UserInstance *ui : owner->m_users)
+			owner->m_name_index.emplace(casefold(ui->nickname, m_client->getCaseMapping()), ui);
+	};
+
+	rebuild(this);
+	for (Channel *c : m_channels)
+		rebuild(c);
+}
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "container.h"
+#include "object_pool.h"
 #include "types.h"
 #include "utils.h"
 #include <set>
+#include <unordered_map>
+#include <vector>
 
 class Channel;
 class IClient;
@@ -11,7 +14,7 @@ class IUserOwner;
 
 // Base class to keep Client-specific data
 
-struct IImplId {
+struct IImplId : PoolAllocated {
 	DISABLE_COPY(IImplId)
 
 	virtual ~IImplId() = default;
@@ -20,6 +23,18 @@ struct IImplId {
 
 	// ID comparison
 	virtual bool is(const IImplId *other) const = 0;
+	// Must be equal for IDs where is() returns true
+	virtual size_t hash() const = 0;
+
+	// For hash containers keyed by "const IImplId *"
+	struct Hash {
+		size_t operator()(const IImplId *id) const
+		{ return id->hash(); }
+	};
+	struct Equal {
+		bool operator()(const IImplId *a, const IImplId *b) const
+		{ return a->is(b); }
+	};
 
 	// Converts the ID to a string representation
 	virtual std::string idStr() const = 0;
@@ -34,12 +49,15 @@ protected:
 
 // This is network-wide
 
-class UserInstance : public Containers {
+class UserInstance : public Containers, public PoolAllocated {
 public:
 	UserInstance(const IImplId &uid);
 	~UserInstance() { delete uid; }
 
 	int getRefs() const { return m_references; }
+	// Channels which contain this user
+	const std::vector<Channel *> &getChannels() const
+	{ return m_channels; }
 
 	IImplId const *uid;
 
@@ -71,8 +89,10 @@ private:
 		if (m_references <= 0)
 			delete this;
 	}
+	void removeChannel(Channel *c);
 
 	int m_references = 0;
+	std::vector<Channel *> m_channels;
 };
 
 class IUserOwner {
@@ -90,15 +110,26 @@ public:
 
 	const std::set<UserInstance *> &getAllUsers() const
 	{ return m_users; }
+	// "name": casefolded nickname. See IClient::findUser
+	UserInstance *getUserByFoldedName(cstr_t &name) const;
 
 protected:
 	IClient *m_client;
 
 	// Per-user data
 	std::set<UserInstance *> m_users;
+
+	friend class Network;
+	void indexUser(UserInstance *ui);
+	void unindexUser(UserInstance *ui);
+
+	// Key: UserInstance::uid
+	std::unordered_map<const IImplId *, UserInstance *, IImplId::Hash, IImplId::Equal> m_user_index;
+	// Key: casefolded UserInstance::nickname, which is not unique everywhere
+	std::unordered_multimap<std::string, UserInstance *> m_name_index;
 };
 
-class Channel : public IUserOwner {
+class Channel : public IUserOwner, public PoolAllocated {
 public:
 	Channel(bool is_private, const IImplId &cid, IClient *cli);
 	~Channel();
@@ -143,11 +174,18 @@ public:
 	std::set<Channel *> &getAllChannels()
 	{ return m_channels; }
 
+	// Changes the nickname, which might be part of the user ID
+	void renameUser(UserInstance *ui, cstr_t &nickname);
+	// After a change of the client's case mapping
+	void rebuildNameIndex();
+
 	//void freeTempChannels();
 
 private:
 	//static const time_t TEMP_CHANNEL_TIMEOUT = 300;
 
 	std::set<Channel *> m_channels;
+	// Key: Channel::cid
+	std::unordered_map<const IImplId *, Channel *, IImplId::Hash, IImplId::Equal> m_channel_index;
 	//std::map<Channel *, time_t> m_channels_temp;
 };
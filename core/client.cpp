@@ -1,5 +1,6 @@
 #include "client.h"
 #include "channel.h"
+#include "http_engine.h"
 #include "logger.h"
 #include "module.h"
 #include "settings.h"
@@ -8,6 +9,7 @@ IClient::IClient(Settings *settings)
 {
 	m_settings = settings;
 
+	m_http = new HTTPEngine(&m_wake);
 	m_network = new Network(this);
 	m_module_mgr = new ModuleMgr(this);
 }
@@ -20,6 +22,10 @@ IClient::~IClient()
 	delete m_network;
 	m_network = nullptr;
 
+	// After the modules: they cancel their requests on unload
+	delete m_http;
+	m_http = nullptr;
+
 	if (m_settings)
 		m_settings->syncFileContents(SR_WRITE);
 }
@@ -31,11 +37,17 @@ IFormatter *IClient::createFormatter() const
 
 UserInstance *IClient::findUser(const IUserOwner *iuo, cstr_t &name)
 {
-	for (UserInstance *ui : iuo->getAllUsers()) {
-		if (strequalsi(ui->nickname, name))
-			return ui;
-	}
-	return nullptr;
+	return iuo->getUserByFoldedName(casefold(name, m_casemapping));
+}
+
+void IClient::setCaseMapping(CaseMapping cm)
+{
+	if (cm == m_casemapping)
+		return;
+
+	m_casemapping = cm;
+	if (m_network)
+		m_network->rebuildNameIndex();
 }
 
 
@@ -44,38 +56,62 @@ void IClient::addRequest(ClientRequest && cr)
 	m_requests_lock.lock();
 	m_requests.push(std::move(cr));
 	m_requests_lock.unlock();
+
+	m_wake.notify();
 }
 
 void IClient::processRequests()
 {
+	m_http->processDone();
+
 	if (m_requests.empty())
 		return;
 
-	ClientRequest cr;
+	// Requests added during processing are handled in the next iteration
+	std::queue<ClientRequest> requests;
 	{
 		m_requests_lock.lock();
-		std::swap(m_requests.front(), cr);
-		m_requests.pop();
+		std::swap(m_requests, requests);
 		m_requests_lock.unlock();
 	}
 
-	VERBOSE("Got request type=" << (int)cr.type);
-
-	if (cr.type == ClientRequest::RT_STATUS_UPDATE)
-		m_module_mgr->client_privatefunc_1(cr.status_update);
-
-	processRequest(cr);
+	for (; !requests.empty(); requests.pop()) {
+		ClientRequest &cr = requests.front();
+		VERBOSE("Got request type=" << (int)cr.type);
+
+		if (cr.type == ClientRequest::RT_STATUS_UPDATE)
+			m_module_mgr->client_privatefunc_1(cr.status_update);
+
+		processRequest(cr);
+
+		// Clean up data
+		switch (cr.type) {
+			case ClientRequest::RT_NONE:
+				break;
+			case ClientRequest::RT_RELOAD_MODULE:
+				delete cr.reload_module.path;
+				break;
+			case ClientRequest::RT_STATUS_UPDATE:
+				break;
+		}
+	}
+}
 
-	// Clean up data
-	switch (cr.type) {
-		case ClientRequest::RT_NONE:
-			return;
-		case ClientRequest::RT_RELOAD_MODULE:
-			delete cr.reload_module.path;
-			return;
-		case ClientRequest::RT_STATUS_UPDATE:
+void IClient::waitForWork()
+{
+	{
+		MutexLock _(m_requests_lock);
+		if (!m_requests.empty())
 			return;
 	}
+
+	m_wake.wait(getWaitTimeout());
+}
+
+float IClient::getWaitTimeout() const
+{
+	// Wake up in time for the next module step
+	return m_module_mgr->getStepDelay();
 }
 
 void IClient::processRequest(ClientRequest &cr)
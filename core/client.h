@@ -2,10 +2,13 @@
 
 #include "clientrequest.h"
 #include "types.h"
+#include "utils.h" // CaseMapping
+#include "wake_event.h"
 #include <queue>
 
 class Channel;
 class Connection;
+class HTTPEngine;
 class IFormatter;
 class IUserOwner;
 class Logger;
@@ -29,10 +32,17 @@ public:
 	{ return m_module_mgr; }
 	Network *getNetwork() const
 	{ return m_network; }
+	HTTPEngine *getHTTPEngine() const
+	{ return m_http; }
 
 	void addRequest(ClientRequest && cr);
 	void processRequests();
 
+	// Blocks the main loop until there is something to do
+	void waitForWork();
+	WakeEvent *getWakeEvent()
+	{ return &m_wake; }
+
 	virtual void sendRaw(cstr_t &text) {} // TODO: remove this
 
 	// Module functions: Actions
@@ -46,14 +56,25 @@ public:
 	virtual IFormatter *createFormatter() const;
 	virtual UserInstance *findUser(const IUserOwner *iuo, cstr_t &name);
 
+	// Used for nickname lookups
+	CaseMapping getCaseMapping() const
+	{ return m_casemapping; }
+	void setCaseMapping(CaseMapping cm);
+
 protected:
 	virtual void processRequest(ClientRequest &cr);
+	// Maximal time to sleep in waitForWork()
+	virtual float getWaitTimeout() const;
 
 	Logger *m_log = nullptr;
 	ModuleMgr *m_module_mgr = nullptr;
 	Network *m_network = nullptr;
 	Settings *m_settings = nullptr;
+	HTTPEngine *m_http = nullptr;
+	CaseMapping m_casemapping = CM_ASCII;
 
 	mutable std::mutex m_requests_lock;
 	std::queue<ClientRequest> m_requests;
+
+	WakeEvent m_wake;
 };
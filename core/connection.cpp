@@ -1,24 +1,99 @@
 #include "connection.h"
 #include "logger.h"
 #include "utils.h" // strtrim
+#include "wake_event.h"
+#include "websocket.h"
 #include <curl/curl.h>
 #include <pthread.h>
 #include <iostream>
+#include <map>
+#include <random>
 #include <sstream>
 #include <string.h>
+#include <vector>
+// Unix only
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 // Init on program start, destruct on close
 struct curl_init {
 	curl_init()
 	{
 		curl_global_init(CURL_GLOBAL_ALL);
+
+		// DNS and TLS session cache for all HTTP handles
+		share = curl_share_init();
+		curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+		curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+		curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
 	}
 	~curl_init()
 	{
+		for (auto &it : pool) {
+			for (CURL *curl : it.second)
+				curl_easy_cleanup(curl);
+		}
+		pool.clear();
+
+		curl_share_cleanup(share);
 		curl_global_cleanup();
 	}
+
+	static void lock(CURL *, curl_lock_data data, curl_lock_access, void *self)
+	{
+		((curl_init *)self)->locks[data].lock();
+	}
+	static void unlock(CURL *, curl_lock_data data, void *self)
+	{
+		((curl_init *)self)->locks[data].unlock();
+	}
+
+	// Idle HTTP handles which keep their connections alive
+	CURL *takeHandle(cstr_t &host)
+	{
+		MutexLock _(pool_lock);
+		auto it = pool.find(host);
+		if (it == pool.end() || it->second.empty())
+			return nullptr;
+
+		CURL *curl = it->second.back();
+		it->second.pop_back();
+		return curl;
+	}
+	bool returnHandle(cstr_t &host, CURL *curl)
+	{
+		MutexLock _(pool_lock);
+		auto &list = pool[host];
+		if (list.size() >= POOL_MAX_PER_HOST)
+			return false;
+
+		// Options are cleared. Connections, DNS and TLS caches are kept.
+		curl_easy_reset(curl);
+		list.push_back(curl);
+		return true;
+	}
+
+	static const size_t POOL_MAX_PER_HOST = 4;
+
+	CURLSH *share;
+	std::mutex locks[CURL_LOCK_DATA_LAST];
+
+	std::mutex pool_lock;
+	std::map<std::string, std::vector<CURL *>> pool;
 } CURL_INIT;
 
+// "https://example.com:8080/foo?bar" -> "https://example.com:8080"
+static std::string get_url_host(cstr_t &url)
+{
+	size_t pos = url.find("://");
+	pos = (pos == std::string::npos) ? 0 : pos + 3;
+	return url.substr(0, url.find_first_of("/?#", pos));
+}
+
 Connection *Connection::createStream(cstr_t &address, int port)
 {
 	Connection *con = new Connection(CT_STREAM);
@@ -34,7 +109,11 @@ Connection *Connection::createStream(cstr_t &address, int port)
 
 Connection *Connection::createHTTP(cstr_t &method, cstr_t &url)
 {
-	Connection *con = new Connection(CT_HTTP);
+	std::string host = get_url_host(url);
+	Connection *con = new Connection(CT_HTTP, CURL_INIT.takeHandle(host));
+	con->m_pool_host = std::move(host);
+
+	curl_easy_setopt(con->m_curl, CURLOPT_SHARE, CURL_INIT.share);
 	curl_easy_setopt(con->m_curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_0);
 	curl_easy_setopt(con->m_curl, CURLOPT_URL, url.c_str());
 
@@ -61,51 +140,74 @@ Connection *Connection::createHTTP(cstr_t &method, cstr_t &url)
 	return con;
 }
 
-Connection *Connection::createWebsocket(cstr_t &url)
+Connection *Connection::createWebsocket(cstr_t &url, bool deflate)
 {
-	Connection *con = new Connection(CT_WEBSOCKET);
-	curl_easy_setopt(con->m_curl, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(con->m_curl, CURLOPT_FOLLOWLOCATION, 1L);
-
-    curl_easy_setopt(con->m_curl, CURLOPT_HEADERFUNCTION, recvAsyncWebsocketHeader);
-    curl_easy_setopt(con->m_curl, CURLOPT_HEADERDATA, con);
-    curl_easy_setopt(con->m_curl, CURLOPT_WRITEFUNCTION, recvAsyncHTTP);
-    curl_easy_setopt(con->m_curl, CURLOPT_WRITEDATA, con);
-	curl_easy_setopt(con->m_curl, CURLOPT_READFUNCTION, sendAsyncHTTP);
-	curl_easy_setopt(con->m_curl, CURLOPT_READDATA, con);
+	// "wss://host:port/path?query"
+	size_t pos = url.find("://");
+	std::string scheme = url.substr(0, pos);
+	pos = (pos == std::string::npos) ? 0 : pos + 3;
+	size_t path_pos = url.find_first_of("/?", pos);
 
-    con->addHTTP_Header("Connection: Upgrade");
-	con->addHTTP_Header("Upgrade: websocket");
-	con->addHTTP_Header("Origin: " + url);
-    con->addHTTP_Header("Sec-WebSocket-Key: SGVsbG8sIHdvcmxkIQ==");
-    con->addHTTP_Header("Sec-WebSocket-Version: 13");
-
-	curl_easy_setopt(con->m_curl, CURLOPT_VERBOSE, 1L);
+	Connection *con = new Connection(CT_WEBSOCKET);
+	con->m_ws_host = url.substr(pos, path_pos - pos);
+	con->m_ws_path = (path_pos == std::string::npos) ? "/" : url.substr(path_pos);
+	if (con->m_ws_path[0] == '?')
+		con->m_ws_path.insert(0, "/");
+	con->m_ws_deflate = deflate;
+
+	// The upgrade request is sent manually after the TLS handshake
+	bool secure = (scheme == "wss" || scheme == "https");
+	std::string address((secure ? "https://" : "http://") + con->m_ws_host);
+	curl_easy_setopt(con->m_curl, CURLOPT_URL, address.c_str());
+	curl_easy_setopt(con->m_curl, CURLOPT_CONNECT_ONLY, 1L);
+	curl_easy_setopt(con->m_curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+	curl_easy_setopt(con->m_curl, CURLOPT_TCP_KEEPALIVE, 1L);
 	return con;
 }
 
-Connection::Connection(ConnectionType ct) :
-	m_type(ct)
+Connection::Connection(ConnectionType ct, void *curl) :
+	m_type(ct),
+	m_curl(curl),
+	m_recv_queue(ct != CT_HTTP ? STREAM_QUEUE_PACKETS : HTTP_QUEUE_PACKETS,
+		ct != CT_HTTP ? STREAM_QUEUE_BYTES : HTTP_MAX_BODY),
+	m_send_queue(HTTP_QUEUE_PACKETS, HTTP_MAX_BODY)
 {
 	// Open connection
-	m_curl = curl_easy_init();
+	if (!m_curl)
+		m_curl = curl_easy_init();
 	ASSERT(m_curl, "CURL init failed");
 
-	curl_easy_setopt(m_curl, CURLOPT_TIMEOUT, CURL_TIMEOUT_MS);
+	curl_easy_setopt(m_curl, CURLOPT_TIMEOUT_MS, CURL_TIMEOUT_MS);
 }
 
 Connection::~Connection()
 {
+	if (m_type == CT_WEBSOCKET && m_connected) {
+		// Status code 1000: normal closure
+		sendFrame(WebSocketFrame::OP_CLOSE, std::string_view("\x03\xE8", 2));
+	}
 	m_connected = false;
 
+	// Interrupt epoll_wait of the receive thread
+	signalWakeFd();
+
 	if (m_thread) {
 		pthread_join(m_thread, nullptr);
 		m_thread = 0;
 	}
 
+	if (m_epoll_fd >= 0)
+		close(m_epoll_fd);
+	if (m_wake_fd >= 0)
+		close(m_wake_fd);
+
 	if (m_http_headers)
 		curl_slist_free_all(m_http_headers);
 
+	// Keep the connection open for the next request to this host
+	if (m_type == CT_HTTP && CURL_INIT.returnHandle(m_pool_host, m_curl))
+		return;
+
 	// Disconnect
 	curl_easy_cleanup(m_curl);
 }
@@ -116,6 +218,32 @@ void Connection::setHTTP_URL(cstr_t &url)
 		return;
 
 	curl_easy_setopt(m_curl, CURLOPT_URL, url.c_str());
+	m_pool_host = get_url_host(url);
+}
+
+void Connection::setHTTP_Timeout(long timeout_ms)
+{
+	if (m_type != CT_HTTP)
+		return;
+
+	curl_easy_setopt(m_curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+}
+
+long Connection::getHTTP_Status() const
+{
+	long status = 0;
+	curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &status);
+	return status;
+}
+
+std::string Connection::getHTTP_ResponseHeader(cstr_t &name) const
+{
+	// Last response after redirects
+	curl_header *header = nullptr;
+	if (curl_easy_header(m_curl, name.c_str(), 0, CURLH_HEADER, -1, &header) != CURLHE_OK)
+		return "";
+
+	return header->value;
 }
 
 void Connection::addHTTP_Header(cstr_t &what)
@@ -131,8 +259,8 @@ void Connection::enqueueHTTP_Send(std::string && data)
 	if (m_type != CT_HTTP)
 		return;
 
-	MutexLock _(m_send_queue_lock);
-	m_send_queue.push(std::move(data));
+	if (!m_send_queue.push(data))
+		WARN("Send queue is full. Dropping " << data.size() << " bytes");
 
 	/*
 	curl_easy_setopt(m_curl, CURLOPT_POSTFIELDSIZE, data.size());
@@ -142,18 +270,24 @@ void Connection::enqueueHTTP_Send(std::string && data)
 
 bool Connection::connect()
 {
-	curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, m_http_headers);
-	CURLcode res = curl_easy_perform(m_curl);
-
-	m_connected = (res == CURLE_OK);
-	if (!m_connected) {
-		ERROR("CURL failed: " << curl_easy_strerror(res));
+	prepareTransfer();
+	if (!finishTransfer(curl_easy_perform(m_curl)))
 		return false;
-	}
 
-	if (m_type == CT_STREAM) {
+	if (m_type == CT_STREAM || m_type == CT_WEBSOCKET) {
+		if (!setupReactor()) {
+			m_connected = false;
+			return false;
+		}
+
+		if (m_type == CT_WEBSOCKET && !upgradeWebsocket()) {
+			m_connected = false;
+			return false;
+		}
+
 		// Start async receive thread
-		int status = pthread_create(&m_thread, nullptr, &recvAsyncStream, this);
+		int status = pthread_create(&m_thread, nullptr,
+			m_type == CT_STREAM ? &recvAsyncStream : &recvAsyncWebsocket, this);
 
 		if (status != 0) {
 			m_connected = false;
@@ -168,6 +302,29 @@ bool Connection::connect()
 	return m_connected;
 }
 
+void Connection::prepareTransfer()
+{
+	curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, m_http_headers);
+	m_recv_body.clear();
+}
+
+bool Connection::finishTransfer(int res_i)
+{
+	CURLcode res = (CURLcode)res_i;
+	m_connected = (res == CURLE_OK);
+	if (!m_connected) {
+		ERROR("CURL failed: " << curl_easy_strerror(res));
+		return false;
+	}
+
+	if (!m_recv_body.empty()) {
+		// Response is complete. Make it available.
+		m_recv_queue.push(m_recv_body);
+		m_recv_body.clear();
+	}
+	return true;
+}
+
 bool Connection::send(cstr_t &data) const
 {
 	if (!m_connected) {
@@ -180,16 +337,34 @@ bool Connection::send(cstr_t &data) const
 	else
 		VERBOSE("<< Sending " << data.size() << " bytes");
 
+	if (m_type == CT_WEBSOCKET)
+		return sendFrame(WebSocketFrame::OP_TEXT, data);
+
+	MutexLock _(m_send_lock);
+	return sendRaw(data.c_str(), data.size());
+}
+
+bool Connection::sendFrame(uint8_t opcode, std::string_view payload) const
+{
+	std::string frame;
+	WebSocketCodec::encodeFrame(opcode, payload, &frame);
+
+	MutexLock _(m_send_lock);
+	return sendRaw(frame.c_str(), frame.size());
+}
+
+bool Connection::sendRaw(const char *data, size_t size) const
+{
 	CURLcode res;
 	int retries = 0;
-	for (size_t sent_total = 0; sent_total < data.size();) {
+	for (size_t sent_total = 0; sent_total < size;) {
 		if (retries == MAX_SEND_RETRIES) {
 			WARN(curl_easy_strerror(res));
 			return false;
 		}
 
 		size_t nsent = 0;
-		res = curl_easy_send(m_curl, &data[sent_total], data.size() - sent_total, &nsent);
+		res = curl_easy_send(m_curl, &data[sent_total], size - sent_total, &nsent);
 		sent_total += nsent;
 
 		if (res == CURLE_OK)
@@ -199,162 +374,500 @@ bool Connection::send(cstr_t &data) const
 
 		// Try waiting for socket
 		if (res == CURLE_AGAIN)
-			SLEEP_MS(10);
+			waitForSocket(POLLOUT, CURL_TIMEOUT_MS);
 	}
 	return true;
 }
 
-std::string *Connection::popRecv()
+bool Connection::popRecv(std::string &out)
 {
-	MutexLock _(m_recv_queue_lock);
-	if (m_recv_queue.size() == 0)
-		return nullptr;
+	if (!m_recv_queue.pop(out))
+		return false;
 
-	// std::swap to avoid memory copy
-	std::string *data = new std::string();
-	std::swap(m_recv_queue.front(), *data);
-	m_recv_queue.pop();
-	return data;
+	onRecvPopped();
+	return true;
+}
+
+size_t Connection::popRecvBatch(std::vector<std::string> &dst)
+{
+	size_t count = m_recv_queue.popBatch(dst);
+	if (count > 0)
+		onRecvPopped();
+	return count;
 }
 
 std::string *Connection::popAll()
 {
-	MutexLock _(m_recv_queue_lock);
-	if (m_recv_queue.size() == 0)
+	std::string *data = new std::string();
+	if (!m_recv_queue.pop(*data)) {
+		delete data;
 		return nullptr;
+	}
 
-	std::string *data = new std::string();
-	data->reserve(m_recv_queue.front().size() * m_recv_queue.size());
+	std::string more;
+	while (m_recv_queue.pop(more))
+		data->append(more);
 
-	while (!m_recv_queue.empty()) {
-		data->append(m_recv_queue.front());
-		m_recv_queue.pop();
-	}
+	onRecvPopped();
 	return data;
 }
 
-size_t Connection::recv(std::string &data)
+size_t Connection::recv(char *buf, size_t size)
 {
-	// Re-use memory wherever possible
-	thread_local char buf[RECEIVE_BUFSIZE];
-
 	size_t nread = 0;
-	CURLcode res = curl_easy_recv(m_curl, buf, sizeof(buf), &nread);
+	CURLcode res = curl_easy_recv(m_curl, buf, size, &nread);
 
-	if (res != CURLE_OK && res != CURLE_AGAIN)
-		WARN(curl_easy_strerror(res));
+	if (res == CURLE_AGAIN)
+		return 0;
 
-	if (nread == 0)
-		return nread;
+	if (res != CURLE_OK) {
+		WARN(curl_easy_strerror(res));
+		m_connected = false;
+		return 0;
+	}
 
-	data.append(buf, nread);
+	if (nread == 0) {
+		LOG("Connection closed by remote host");
+		m_connected = false;
+		return 0;
+	}
 
 	return nread;
 }
 
+bool Connection::setupReactor()
+{
+	curl_socket_t sock = CURL_SOCKET_BAD;
+	CURLcode res = curl_easy_getinfo(m_curl, CURLINFO_ACTIVESOCKET, &sock);
+	if (res != CURLE_OK || sock == CURL_SOCKET_BAD) {
+		ERROR("Cannot obtain socket: " << curl_easy_strerror(res));
+		return false;
+	}
+	m_socket = sock;
+
+	m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_epoll_fd < 0 || m_wake_fd < 0) {
+		ERROR("epoll/eventfd failed: " << strerror(errno));
+		return false;
+	}
+
+	epoll_event ev {};
+	ev.events = EPOLLIN;
+	ev.data.fd = m_socket;
+	bool ok = epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_socket, &ev) == 0;
+
+	ev.data.fd = m_wake_fd;
+	ok &= epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &ev) == 0;
+
+	if (!ok)
+		ERROR("epoll_ctl failed: " << strerror(errno));
+	return ok;
+}
+
+void Connection::waitForEvents()
+{
+	epoll_event events[2];
+	int n = epoll_wait(m_epoll_fd, events, 2, -1);
+	if (n < 0 && errno != EINTR) {
+		ERROR("epoll_wait failed: " << strerror(errno));
+		m_connected = false;
+		return;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (events[i].data.fd != m_wake_fd)
+			continue;
+
+		// Reset the wake-up counter
+		uint64_t count;
+		if (read(m_wake_fd, &count, sizeof(count)) < 0)
+			WARN("eventfd read failed: " << strerror(errno));
+	}
+}
+
+void Connection::signalWakeFd() const
+{
+	if (m_wake_fd < 0)
+		return;
+
+	uint64_t one = 1;
+	if (write(m_wake_fd, &one, sizeof(one)) < 0)
+		WARN("eventfd write failed: " << strerror(errno));
+}
+
+bool Connection::pushRecv(std::string_view data)
+{
+	if (m_recv_queue.push(data))
+		return true;
+
+	// Queue is full. Set the flag before retrying, so that a pop in
+	// between cannot be missed by onRecvPopped().
+	m_recv_blocked = true;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	while (!m_recv_queue.push(data)) {
+		if (!m_connected) {
+			m_recv_blocked = false;
+			return false;
+		}
+		// Wait for the consumer to catch up
+		if (m_wake)
+			m_wake->notify();
+		waitForConsumer();
+	}
+	m_recv_blocked = false;
+	return true;
+}
+
+void Connection::waitForConsumer()
+{
+	pollfd pfd {};
+	pfd.fd = m_wake_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+		ERROR("poll failed: " << strerror(errno));
+		m_connected = false;
+		return;
+	}
+
+	// Reset the wake-up counter
+	uint64_t count;
+	if (read(m_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		WARN("eventfd read failed: " << strerror(errno));
+}
+
+void Connection::onRecvPopped()
+{
+	// Pairs with the fence in pushRecv()
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_recv_blocked)
+		signalWakeFd();
+}
+
+bool Connection::waitForSocket(short events, int timeout_ms) const
+{
+	if (m_socket < 0)
+		return false;
+
+	pollfd pfd {};
+	pfd.fd = m_socket;
+	pfd.events = events;
+	return poll(&pfd, 1, timeout_ms) > 0;
+}
+
 void *Connection::recvAsyncStream(void *con_p)
 {
 	Connection *con = (Connection *)con_p;
 	// Receive thread function
-	std::string data;
+	LineBuffer data(RECEIVE_BUFSIZE_MIN, RECEIVE_BUFSIZE_MAX);
 
 	LOG("Start!");
 	while (con->m_connected) {
-		size_t nread = con->recv(data);
+		size_t size;
+		char *buf = data.prepareWrite(&size);
+		size_t nread = con->recv(buf, size);
 		if (nread == 0) {
-			SLEEP_MS(100);
+			// Everything read. Sleep until there is more.
+			con->waitForEvents();
 			continue;
 		}
+		data.commitWrite(nread);
 
-		size_t offset = 0;
-		while (true) {
-			// Search for newlines and split
-			size_t index = data.find('\n', offset);
-			if (index == std::string::npos)
-				break;
+		std::string_view line;
+		if (!data.popLine(&line))
+			continue;
 
-			if (index == offset) {
-				// Empty line
-				offset++;
+		do {
+			if (con->m_line_filter && con->m_line_filter(con, line))
 				continue;
-			}
-
-			// Strip prepending ':'
-			// This is for IRC only!
-			if (data[offset] == ':')
-				offset++;
-
-			int length = index - offset;
-			bool has_cr = (data[index - 1] == '\r');
-
-			{
-				MutexLock _(con->m_recv_queue_lock);
-				con->m_recv_queue.push(data.substr(offset, length - has_cr));
-			}
 
-			offset += length + 1; // + '\n'
-		}
+			// The only copy of the received data
+			if (!con->pushRecv(line))
+				break;
+		} while (data.popLine(&line));
 
-		if (offset > 0) {
-			// Keep leftover text
-			if (offset < data.size())
-				data = data.substr(offset);
-			else
-				data.clear();
-		}
+		if (con->m_wake)
+			con->m_wake->notify();
 	}
 
-	LOG("Stop!");
+	LOG("Stop! Receive queue peak: " << con->m_recv_queue.getHighWaterMark() << " bytes");
+	if (con->m_wake)
+		con->m_wake->notify(); // Report the disconnect
 	return nullptr;
 }
 
 size_t Connection::recvAsyncHTTP(void *buffer, size_t size, size_t nitems, void *con_p)
 {
 	Connection *con = (Connection *)con_p;
+	size_t length = nitems * size;
 
-	MutexLock _(con->m_recv_queue_lock);
-	con->m_recv_queue.push(std::string());
-	auto &pkt = con->m_recv_queue.back();
-	pkt.resize(nitems * size);
-	memcpy(&pkt[0], buffer, pkt.size());
+	if (con->m_recv_body.size() + length > HTTP_MAX_BODY) {
+		WARN("Response exceeds " << HTTP_MAX_BODY << " bytes. Aborting.");
+		return 0;
+	}
 
-	return pkt.size();
+	con->m_recv_body.append((const char *)buffer, length);
+	return length;
 }
 
 size_t Connection::sendAsyncHTTP(void *buffer, size_t size, size_t nitems, void *con_p)
 {
 	Connection *con = (Connection *)con_p;
 
-	MutexLock _(con->m_send_queue_lock);
-	if (con->m_send_queue.empty())
-		return 0;
-
-	std::string &what = con->m_send_queue.front();
+	std::string &what = con->m_send_current;
+	if (con->m_send_index >= what.size()) {
+		con->m_send_index = 0;
+		if (!con->m_send_queue.pop(what))
+			return 0;
+	}
 
 	size_t to_send = std::min(nitems * size, what.size() - con->m_send_index);
 	memcpy(buffer, &what[con->m_send_index], to_send);
 
 	con->m_send_index += to_send;
-	if (con->m_send_index >= what.size()) {
-		con->m_send_queue.pop();
-		con->m_send_index = 0;
+	return to_send;
+}
+
+// Case-insensitive lookup of a HTTP header field
+static std::string_view get_header_field(std::string_view header, std::string_view name)
+{
+	for (size_t pos = 0; pos < header.size();) {
+		size_t end = header.find("\r\n", pos);
+		if (end == std::string_view::npos)
+			end = header.size();
+
+		std::string_view line = header.substr(pos, end - pos);
+		pos = end + 2;
+
+		if (line.size() <= name.size() || line[name.size()] != ':')
+			continue;
+		if (strncasecmp(line.data(), name.data(), name.size()) != 0)
+			continue;
+
+		line.remove_prefix(name.size() + 1);
+		while (!line.empty() && line[0] == ' ')
+			line.remove_prefix(1);
+		return line;
+	}
+	return std::string_view();
+}
+
+bool Connection::upgradeWebsocket()
+{
+	m_ws.reset(new WebSocketCodec(RECEIVE_BUFSIZE_MIN, WEBSOCKET_MAX_MESSAGE));
+
+	uint8_t nonce[16];
+	std::random_device rd;
+	for (uint8_t &v : nonce)
+		v = rd();
+	std::string key = base64encode(nonce, sizeof(nonce));
+
+	std::string request =
+		"GET " + m_ws_path + " HTTP/1.1\r\n"
+		"Host: " + m_ws_host + "\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: " + key + "\r\n"
+		"Sec-WebSocket-Version: 13\r\n";
+	if (m_ws_deflate)
+		request.append("Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n");
+	for (curl_slist *it = m_http_headers; it; it = it->next)
+		request.append(it->data).append("\r\n");
+	request.append("\r\n");
+
+	{
+		MutexLock _(m_send_lock);
+		if (!sendRaw(request.c_str(), request.size()))
+			return false;
 	}
 
-	return to_send;
+	// Read the response. It might be followed by the first frames.
+	auto timeout = std::chrono::high_resolution_clock::now()
+		+ std::chrono::milliseconds(CURL_TIMEOUT_MS);
+	std::string_view header;
+	while (!m_ws->popHeader(&header)) {
+		if (m_ws->hasError() || std::chrono::high_resolution_clock::now() > timeout) {
+			ERROR("WebSocket upgrade: no valid response");
+			return false;
+		}
+
+		size_t size;
+		char *buf = m_ws->prepareWrite(&size);
+		size_t nread = recv(buf, size);
+		if (!m_connected)
+			return false;
+
+		if (nread == 0)
+			waitForSocket(POLLIN, 100);
+		else
+			m_ws->commitWrite(nread);
+	}
+
+	if (header.substr(0, 12) != "HTTP/1.1 101") {
+		ERROR("WebSocket upgrade failed: " << header.substr(0, header.find('\r')));
+		return false;
+	}
+
+	// Proof that the server understood the request
+	static const std::string GUID("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+	std::string digest = sha1((key + GUID).c_str(), key.size() + GUID.size());
+	if (get_header_field(header, "Sec-WebSocket-Accept") != base64encode(digest.c_str(), digest.size())) {
+		ERROR("WebSocket upgrade: invalid Sec-WebSocket-Accept");
+		return false;
+	}
+
+	std::string extensions(get_header_field(header, "Sec-WebSocket-Extensions"));
+	if (m_ws_deflate && strfindi(extensions, "permessage-deflate") != std::string::npos)
+		m_ws->enableDeflate(strfindi(extensions, "server_no_context_takeover") == std::string::npos);
+
+	VERBOSE("WebSocket connected to " << m_ws_host);
+	return true;
 }
 
-size_t Connection::recvAsyncWebsocketHeader(void *buffer, size_t size, size_t nitems, void *con_p)
+void *Connection::recvAsyncWebsocket(void *con_p)
 {
 	Connection *con = (Connection *)con_p;
+	// Receive thread function
+	WebSocketCodec &codec = *con->m_ws;
+
+	LOG("Start!");
+	while (con->m_connected) {
+		// Process everything received so far, including data from the upgrade
+		bool notify = false;
+		WebSocketFrame msg;
+		while (con->m_connected && codec.popMessage(&msg)) {
+			switch (msg.opcode) {
+				case WebSocketFrame::OP_PING:
+					con->sendFrame(WebSocketFrame::OP_PONG, msg.payload);
+					break;
+				case WebSocketFrame::OP_PONG:
+					break;
+				case WebSocketFrame::OP_CLOSE:
+					LOG("Connection closed by remote host");
+					// Echo the status code
+					con->sendFrame(WebSocketFrame::OP_CLOSE, msg.payload.substr(0, 2));
+					con->m_connected = false;
+					break;
+				case WebSocketFrame::OP_TEXT:
+				case WebSocketFrame::OP_BINARY:
+					// The only copy of an unfragmented message
+					con->pushRecv(msg.payload);
+					notify = true;
+					break;
+			}
+		}
+
+		if (codec.hasError()) {
+			// Status code 1002: protocol error
+			con->sendFrame(WebSocketFrame::OP_CLOSE, std::string_view("\x03\xEA", 2));
+			con->m_connected = false;
+		}
+
+		if (notify && con->m_wake)
+			con->m_wake->notify();
+		if (!con->m_connected)
+			break;
 
-	long response_code = 0;
-	curl_easy_getinfo(con->m_curl, CURLINFO_RESPONSE_CODE, &response_code);
-	if (response_code == 101) {
-		// Redirect OK
-	} else {
-		// Error?
-		//WARN("Got status code: " << response_code);
+		size_t size;
+		char *buf = codec.prepareWrite(&size);
+		size_t nread = con->recv(buf, size);
+		if (nread == 0) {
+			// Everything read. Sleep until there is more.
+			con->waitForEvents();
+			continue;
+		}
+		codec.commitWrite(nread);
+	}
+
+	LOG("Stop! Receive queue peak: " << con->m_recv_queue.getHighWaterMark() << " bytes");
+	if (con->m_wake)
+		con->m_wake->notify(); // Report the disconnect
+	return nullptr;
+}
+
+
+// ================= LineBuffer =================
+
+LineBuffer::LineBuffer(size_t initial_size, size_t max_size) :
+	m_size(initial_size), m_max_size(max_size)
+{
+	m_data.reset(new char[m_size]);
+}
+
+char *LineBuffer::prepareWrite(size_t *size)
+{
+	if (m_begin == m_end) {
+		// Everything consumed. Start over.
+		m_begin = m_scan = m_end = 0;
+	}
+
+	bool is_full = (m_end == m_size);
+	if ((m_filled || is_full) && m_size < m_max_size) {
+		// Large bursts or long lines: read more at once
+		size_t new_size = std::min(m_size * 2, m_max_size);
+		char *data = new char[new_size];
+		memcpy(data, &m_data[m_begin], m_end - m_begin);
+		m_data.reset(data);
+		m_size = new_size;
+		m_scan -= m_begin;
+		m_end -= m_begin;
+		m_begin = 0;
+	} else if (m_begin > 0 && m_end > m_size / 2) {
+		// Move the incomplete line to the front
+		memmove(&m_data[0], &m_data[m_begin], m_end - m_begin);
+		m_scan -= m_begin;
+		m_end -= m_begin;
+		m_begin = 0;
+	} else if (is_full) {
+		WARN("Line exceeds " << m_max_size << " bytes. Discarding.");
+		m_begin = m_scan = m_end = 0;
+		// The remainder must not be taken as a new line
+		m_discarding = true;
 	}
+	m_filled = false;
 
-	return nitems * size;
+	m_offered = m_size - m_end;
+	*size = m_offered;
+	return &m_data[m_end];
+}
+
+void LineBuffer::commitWrite(size_t nread)
+{
+	m_filled = (nread == m_offered && m_offered >= m_size / 2);
+	m_end += nread;
+}
+
+bool LineBuffer::popLine(std::string_view *line)
+{
+	while (m_scan < m_end) {
+		char *start = &m_data[m_scan];
+		char *pos = (char *)memchr(start, '\n', m_end - m_scan);
+		if (!pos) {
+			m_scan = m_end;
+			if (m_discarding)
+				m_begin = m_end; // Drop the received part
+			return false;
+		}
+
+		size_t index = m_scan + (pos - start);
+		if (m_discarding) {
+			// End of the oversized line
+			m_discarding = false;
+			m_begin = m_scan = index + 1;
+			continue;
+		}
+
+		size_t length = index - m_begin;
+		if (length > 0 && m_data[index - 1] == '\r')
+			length--;
+
+		*line = std::string_view(&m_data[m_begin], length);
+		m_begin = m_scan = index + 1;
+
+		if (length > 0)
+			return true;
+		// Empty line: try next
+	}
+	return false;
 }
@@ -1,7 +1,10 @@
 #pragma once
 
+#include "packet_queue.h"
 #include "types.h"
-#include <queue>
+#include <atomic>
+#include <memory> // unique_ptr
+#include <string_view>
 //#include <thread>
 
 enum ConnectionType {
@@ -12,48 +15,154 @@ enum ConnectionType {
 };
 
 struct curl_slist;
+class WakeEvent;
+class WebSocketCodec;
+
+// Reusable receive buffer which splits the data into lines.
+// The returned lines are views into the buffer, valid until the next write.
+class LineBuffer {
+public:
+	LineBuffer(size_t initial_size, size_t max_size);
+	DISABLE_COPY(LineBuffer);
+
+	// Returns the space to receive new data into
+	char *prepareWrite(size_t *size);
+	void commitWrite(size_t nread);
+
+	// Returns the next line without line terminator. Skips empty lines.
+	bool popLine(std::string_view *line);
+
+	size_t capacity() const
+	{ return m_size; }
+
+private:
+	std::unique_ptr<char[]> m_data;
+	size_t m_size;
+	const size_t m_max_size;
+	size_t m_begin = 0; // First unconsumed byte
+	size_t m_scan = 0;  // Next byte to search for '\n'
+	size_t m_end = 0;   // End of the received data
+	size_t m_offered = 0;
+	bool m_filled = false; // Whether the last write was limited by the buffer size
+	bool m_discarding = false; // Skip until after the next '\n' (oversized line)
+};
 
 class Connection {
 public:
+	// Called by the receive thread for each received stream line.
+	// Returns true if the line was handled and shall not be queued.
+	typedef bool (*LineFilter)(Connection *con, std::string_view line);
+
 	static Connection *createStream(cstr_t &address, int port);
 	static Connection *createHTTP(cstr_t &method, cstr_t &url);
-	static Connection *createWebsocket(cstr_t &url);
+	// RFC 6455 client. Each text or binary message is one received packet.
+	// "deflate": request permessage-deflate compression
+	static Connection *createWebsocket(cstr_t &url, bool deflate = false);
 
 	~Connection();
 	DISABLE_COPY(Connection);
 
 	void setHTTP_URL(cstr_t &url);
+	// Maximal duration of the whole transfer. Default: 5 seconds
+	void setHTTP_Timeout(long timeout_ms);
 	void addHTTP_Header(cstr_t &what);
+	// Response information, available after the transfer
+	long getHTTP_Status() const;
+	std::string getHTTP_ResponseHeader(cstr_t &name) const;
 	void enqueueHTTP_Send(std::string && data);
+	// Signalled by the receive thread whenever new data arrived
+	void setWakeEvent(WakeEvent *ev)
+	{ m_wake = ev; }
+	// Must be set before connect()
+	void setLineFilter(LineFilter filter)
+	{ m_line_filter = filter; }
 	bool connect();
 
 	bool send(cstr_t &data) const;
-	std::string *popRecv();
+	bool isConnected() const
+	{ return m_connected; }
+	bool popRecv(std::string &out);
+	// Appends all received packets to "dst"
+	size_t popRecvBatch(std::vector<std::string> &dst);
 	std::string *popAll();
 
+	// Limits the memory used by received, unprocessed data
+	void setRecvLimit(size_t max_bytes)
+	{ m_recv_queue.setMaxBytes(max_bytes); }
+	size_t getRecvHighWaterMark() const
+	{ return m_recv_queue.getHighWaterMark(); }
+
 private:
-	Connection(ConnectionType ct);
+	friend class HTTPEngine;
+
+	// "curl": re-used handle or nullptr
+	Connection(ConnectionType ct, void *curl = nullptr);
 
 	static const unsigned MAX_SEND_RETRIES = 5;
 	static const long CURL_TIMEOUT_MS = 5000;
-	static const unsigned RECEIVE_BUFSIZE = 1024;
+	// Receive queue limits for streams. Exceeding stalls the receive thread.
+	static const size_t STREAM_QUEUE_PACKETS = 4096;
+	static const size_t STREAM_QUEUE_BYTES = 4 * 1024 * 1024;
+	// HTTP responses are queued as single packet
+	static const size_t HTTP_QUEUE_PACKETS = 16;
+	static const size_t HTTP_MAX_BODY = 32 * 1024 * 1024;
 
-	size_t recv(std::string &data);
+	// Initial and maximal size of the line buffer
+	static const size_t RECEIVE_BUFSIZE_MIN = 4 * 1024;
+	static const size_t RECEIVE_BUFSIZE_MAX = 64 * 1024;
+	static const size_t WEBSOCKET_MAX_MESSAGE = 16 * 1024 * 1024;
+
+	// HTTP: before and after the transfer. "res" is a CURLcode.
+	void prepareTransfer();
+	bool finishTransfer(int res);
+	// Caller must hold m_send_lock
+	bool sendRaw(const char *data, size_t size) const;
+	bool sendFrame(uint8_t opcode, std::string_view payload) const;
+	size_t recv(char *buf, size_t size);
+	bool setupReactor();
+	void waitForEvents();
+	// Interrupts waitForEvents() and waitForConsumer()
+	void signalWakeFd() const;
+	// Receive thread: Blocks while the queue is full. False on disconnect.
+	bool pushRecv(std::string_view data);
+	void waitForConsumer();
+	// Consumer: Resumes a receive thread blocked in pushRecv()
+	void onRecvPopped();
+	bool waitForSocket(short events, int timeout_ms) const;
 	static void *recvAsyncStream(void *con);
 	static size_t recvAsyncHTTP(void *buffer, size_t size, size_t nitems, void *con_p);
 	static size_t sendAsyncHTTP(void *buffer, size_t size, size_t nitems, void *con_p);
-	static size_t recvAsyncWebsocketHeader(void *buffer, size_t size, size_t nitems, void *con_p);
+	bool upgradeWebsocket();
+	static void *recvAsyncWebsocket(void *con);
 
 	const ConnectionType m_type;
 	void *m_curl;
 	curl_slist *m_http_headers = nullptr;
-	bool m_connected = false;
+	std::atomic<bool> m_connected = false;
+	WakeEvent *m_wake = nullptr;
+	LineFilter m_line_filter = nullptr;
 
 	// Receive thread
 	pthread_t m_thread = 0;
+	int m_socket = -1;
+	int m_epoll_fd = -1;
+	int m_wake_fd = -1; // eventfd to interrupt epoll_wait
+	PacketQueue m_recv_queue;
+	std::atomic<bool> m_recv_blocked = false; // Waiting for the consumer
+	PacketQueue m_send_queue;
+	// Sending from the main and the receive thread
+	mutable std::mutex m_send_lock;
+
+	// HTTP: handle pool key
+	std::string m_pool_host;
+	// HTTP: data in transfer
+	std::string m_recv_body;
+	std::string m_send_current;
 	size_t m_send_index = 0;
-	std::queue<std::string> m_recv_queue;
-	std::queue<std::string> m_send_queue;
-	mutable std::mutex m_recv_queue_lock;
-	mutable std::mutex m_send_queue_lock;
+
+	// WebSocket
+	std::string m_ws_host;
+	std::string m_ws_path;
+	bool m_ws_deflate = false;
+	std::unique_ptr<WebSocketCodec> m_ws;
 };
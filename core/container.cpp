@@ -1,56 +1,186 @@
 #include "container.h"
 #include "logger.h"
 
+// ================= ContainerOwner =================
+
+// Slot 0 is used for the "nullptr" owner
+struct ContainerSlots {
+	std::mutex lock;
+	std::vector<size_t> generations { 0 }; // Index: slot
+	std::vector<size_t> unused;
+};
+
+static ContainerSlots &get_container_slots()
+{
+	// Never freed: owners might be destructed after the static data
+	static ContainerSlots *slots = new ContainerSlots();
+	return *slots;
+}
+
+ContainerOwner::~ContainerOwner()
+{
+	if (m_container_slot != 0 && !m_slot_reserved)
+		releaseContainerSlot(m_container_slot);
+}
+
+size_t ContainerOwner::getContainerSlot() const
+{
+	if (m_container_slot != 0)
+		return m_container_slot;
+
+	ContainerSlots &slots = get_container_slots();
+	MutexLock _(slots.lock);
+	if (slots.unused.empty()) {
+		m_container_slot = slots.generations.size();
+		slots.generations.push_back(0);
+	} else {
+		m_container_slot = slots.unused.back();
+		slots.unused.pop_back();
+	}
+	m_container_gen = slots.generations[m_container_slot];
+	return m_container_slot;
+}
+
+size_t ContainerOwner::getContainerGeneration() const
+{
+	getContainerSlot();
+	return m_container_gen;
+}
+
+size_t ContainerOwner::reserveContainerSlot()
+{
+	m_slot_reserved = true;
+	return getContainerSlot();
+}
+
+void ContainerOwner::releaseContainerSlot(size_t slot)
+{
+	ContainerSlots &slots = get_container_slots();
+	MutexLock _(slots.lock);
+	// Invalidates the data of the previous owner
+	slots.generations[slot]++;
+	slots.unused.push_back(slot);
+}
+
+size_t ContainerOwner::getSlotGeneration(size_t slot)
+{
+	ContainerSlots &slots = get_container_slots();
+	MutexLock _(slots.lock);
+	return slot < slots.generations.size() ? slots.generations[slot] : 0;
+}
+
+
+// ================= Containers =================
+
+static inline size_t get_slot(const ContainerOwner *owner)
+{
+	return owner ? owner->getContainerSlot() : 0;
+}
+
+static inline size_t get_generation(const ContainerOwner *owner)
+{
+	return owner ? owner->getContainerGeneration() : 0;
+}
+
 Containers::~Containers()
 {
-	for (auto &it : m_data) {
-		delete it.second;
-		it.second = nullptr;
+	for (Entry &e : m_data) {
+		delete e.data;
+		e.data = nullptr;
+	}
+}
+
+Containers::Entry &Containers::getEntry(const ContainerOwner *owner)
+{
+	size_t slot = get_slot(owner);
+	if (slot >= m_data.size())
+		m_data.resize(slot + 1);
+
+	Entry &e = m_data[slot];
+	size_t generation = get_generation(owner);
+	if (e.data && e.generation != generation) {
+		// Left over by a destructed owner
+		VERBOSE("Dropping stale container " << e.data->dump());
+		delete e.data;
+		e.data = nullptr;
+		m_count--;
 	}
+	e.generation = generation;
+	return e;
+}
+
+const Containers::Entry *Containers::findEntry(const ContainerOwner *owner) const
+{
+	size_t slot = get_slot(owner);
+	if (slot >= m_data.size())
+		return nullptr;
+
+	const Entry &e = m_data[slot];
+	return (e.data && e.generation == get_generation(owner)) ? &e : nullptr;
 }
 
 void Containers::set(const ContainerOwner *owner, IContainer *data)
 {
-	IContainer *existing = get(owner);
-	if (existing && existing != data) {
+	Entry &e = getEntry(owner);
+	if (e.data && e.data != data) {
 		WARN("Overwriting existing container data! "
-			<< "old=" << existing->dump()
+			<< "old=" << e.data->dump()
 			<< ", new=" << data->dump());
-		delete existing;
+		delete e.data;
+		m_count--;
 	}
 
 	VERBOSE(data->dump());
-	m_data.insert({owner, data});
+	if (e.data != data)
+		m_count++;
+	e.data = data;
 }
 
 IContainer *Containers::get(const ContainerOwner *owner) const
 {
-	auto it = m_data.find(owner);
-	return (it == m_data.end()) ? nullptr : it->second;
+	const Entry *e = findEntry(owner);
+	return e ? e->data : nullptr;
 }
 
 bool Containers::remove(const ContainerOwner *owner)
 {
-	auto it = m_data.find(owner);
-	if (it == m_data.end()) {
+	Entry *e = const_cast<Entry *>(findEntry(owner));
+	if (!e) {
 		VERBOSE("Attempt to remove non-existent container");
 		return false;
 	}
 
-	VERBOSE(it->second->dump());
-	delete it->second;
-	m_data.erase(it);
+	VERBOSE(e->data->dump());
+	delete e->data;
+	e->data = nullptr;
+	m_count--;
 	return true;
 }
 
 bool Containers::move(const ContainerOwner *old_owner, const ContainerOwner *new_owner)
 {
-	auto it = m_data.find(old_owner);
-	if (it == m_data.end() || m_data.find(new_owner) != m_data.end())
+	return moveEntry(get_slot(old_owner), get_generation(old_owner), new_owner);
+}
+
+bool Containers::move(size_t old_slot, const ContainerOwner *new_owner)
+{
+	// Reserved slots keep their generation until released
+	return moveEntry(old_slot, ContainerOwner::getSlotGeneration(old_slot), new_owner);
+}
+
+bool Containers::moveEntry(size_t old_slot, size_t old_gen, const ContainerOwner *new_owner)
+{
+	if (old_slot >= m_data.size())
+		return false;
+	if (!m_data[old_slot].data || m_data[old_slot].generation != old_gen)
+		return false;
+	if (findEntry(new_owner))
 		return false;
 
-	IContainer *c = it->second;
-	m_data.erase(it);
-	m_data.insert({new_owner, c});
+	// getEntry() may reallocate
+	Entry &dst = getEntry(new_owner);
+	Entry &src = m_data[old_slot];
+	dst.data = src.data;
+	src.data = nullptr;
 	return true;
 }
@@ -2,13 +2,35 @@
 
 #include "clientrequest.h"
 #include "types.h"
-#include <map>
 #include <vector>
 
 class UserInstance;
 class Channel;
 
-struct ContainerOwner {};
+// Anything which stores data in Containers. Receives a small, dense slot
+// number on first use, which is recycled after destruction. The generation
+// of a slot changes on each recycle to tell apart its owners.
+struct ContainerOwner {
+	ContainerOwner() = default;
+	// Copies are separate owners
+	ContainerOwner(const ContainerOwner &) {}
+	ContainerOwner &operator=(const ContainerOwner &) { return *this; }
+	~ContainerOwner();
+
+	size_t getContainerSlot() const;
+	size_t getContainerGeneration() const;
+	// Keeps the slot assigned after destruction, so that the data can be
+	// moved to a new owner. Free it with releaseContainerSlot() afterwards.
+	size_t reserveContainerSlot();
+	static void releaseContainerSlot(size_t slot);
+	// Generation of the current or last owner of "slot"
+	static size_t getSlotGeneration(size_t slot);
+
+private:
+	mutable size_t m_container_slot = 0; // 0: not assigned yet
+	mutable size_t m_container_gen = 0;
+	bool m_slot_reserved = false;
+};
 
 class ICallbackHandler : public ContainerOwner {
 public:
@@ -43,9 +65,23 @@ public:
 	IContainer *get(const ContainerOwner *owner) const;
 	bool remove(const ContainerOwner *owner);
 	bool move(const ContainerOwner *old_owner, const ContainerOwner *new_owner);
-	inline size_t size() const { return m_data.size(); }
+	// For destructed owners, by their reserved slot
+	bool move(size_t old_slot, const ContainerOwner *new_owner);
+	inline size_t size() const { return m_count; }
 
 private:
-	std::map<const ContainerOwner *, IContainer *> m_data;
+	struct Entry {
+		// Slots are recycled: the generation tells whether the data is still valid
+		size_t generation = 0;
+		IContainer *data = nullptr;
+	};
+
+	// Creates the entry if needed
+	Entry &getEntry(const ContainerOwner *owner);
+	const Entry *findEntry(const ContainerOwner *owner) const;
+	bool moveEntry(size_t old_slot, size_t old_gen, const ContainerOwner *new_owner);
+
+	std::vector<Entry> m_data; // Index: slot
+	size_t m_count = 0;
 };
 
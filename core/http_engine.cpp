@@ -0,0 +1,206 @@
+#include "http_engine.h"
+#include "connection.h"
+#include "logger.h"
+#include "wake_event.h"
+#include <curl/curl.h>
+#include <string.h> // strerror
+
+HTTPEngine::HTTPEngine(WakeEvent *wake) :
+	m_wake(wake)
+{
+	m_multi = curl_multi_init();
+	ASSERT(m_multi, "CURL multi init failed");
+
+	curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(m_multi, CURLMOPT_MAX_HOST_CONNECTIONS, MAX_HOST_CONNECTIONS);
+
+	int status = pthread_create(&m_thread, nullptr, &runAsync, this);
+	if (status != 0) {
+		m_thread = 0;
+		ERROR("pthread failed: " << strerror(status));
+	}
+}
+
+HTTPEngine::~HTTPEngine()
+{
+	m_running = false;
+	curl_multi_wakeup(m_multi);
+
+	if (m_thread) {
+		pthread_join(m_thread, nullptr);
+		m_thread = 0;
+	}
+
+	for (Request &r : m_active) {
+		curl_multi_remove_handle(m_multi, r.con->m_curl);
+		delete r.con;
+	}
+	for (Request &r : m_new)
+		delete r.con;
+	for (Request &r : m_done)
+		delete r.con;
+
+	curl_multi_cleanup(m_multi);
+}
+
+void HTTPEngine::enqueue(const void *owner, Connection *con, Callback && cb)
+{
+	ASSERT(con->m_type == CT_HTTP, "Expected a HTTP connection");
+
+	{
+		MutexLock _(m_lock);
+		m_new.push_back(Request { owner, con, std::move(cb) });
+	}
+	curl_multi_wakeup(m_multi);
+}
+
+size_t HTTPEngine::processDone()
+{
+	std::list<Request> done;
+	{
+		MutexLock _(m_lock);
+		if (m_done.empty())
+			return 0;
+		done.swap(m_done);
+	}
+
+	for (Request &r : done) {
+		if (r.callback)
+			r.callback(r.con, r.ok);
+		delete r.con;
+	}
+	return done.size();
+}
+
+void HTTPEngine::cancel(const void *owner)
+{
+	auto erase_owned = [owner] (std::list<Request> &list) {
+		for (auto it = list.begin(); it != list.end();) {
+			if (it->owner == owner) {
+				delete it->con;
+				it = list.erase(it);
+			} else {
+				++it;
+			}
+		}
+	};
+
+	MutexLock _(m_lock);
+	erase_owned(m_new);
+	erase_owned(m_done);
+
+	// The callback might reference code that is about to be unloaded
+	bool any_active = false;
+	for (Request &r : m_active) {
+		if (r.owner == owner && !r.cancelled) {
+			r.cancelled = true;
+			r.callback = nullptr;
+			any_active = true;
+		}
+	}
+
+	if (any_active)
+		curl_multi_wakeup(m_multi);
+}
+
+size_t HTTPEngine::getPending() const
+{
+	MutexLock _(m_lock);
+	return m_new.size() + m_active.size() + m_done.size();
+}
+
+void *HTTPEngine::runAsync(void *e_raw)
+{
+	HTTPEngine *e = (HTTPEngine *)e_raw;
+
+	while (e->m_running) {
+		e->updateRequests();
+
+		int running = 0;
+		CURLMcode mc = curl_multi_perform(e->m_multi, &running);
+		if (mc != CURLM_OK) {
+			// The callbacks must still run, e.g. to restart polling
+			ERROR("CURL multi failed: " << curl_multi_strerror(mc));
+			e->failAll();
+		}
+
+		int left = 0;
+		while (CURLMsg *msg = curl_multi_info_read(e->m_multi, &left)) {
+			if (msg->msg == CURLMSG_DONE)
+				e->finishRequest(msg->easy_handle, msg->data.result);
+		}
+
+		curl_multi_poll(e->m_multi, nullptr, 0, POLL_TIMEOUT_MS, nullptr);
+	}
+
+	return nullptr;
+}
+
+void HTTPEngine::updateRequests()
+{
+	MutexLock _(m_lock);
+
+	// Abort cancelled transfers
+	for (auto it = m_active.begin(); it != m_active.end();) {
+		if (!it->cancelled) {
+			++it;
+			continue;
+		}
+
+		curl_multi_remove_handle(m_multi, it->con->m_curl);
+		delete it->con;
+		it = m_active.erase(it);
+	}
+
+	for (Request &r : m_new) {
+		r.con->prepareTransfer();
+		curl_multi_add_handle(m_multi, r.con->m_curl);
+	}
+	m_active.splice(m_active.end(), m_new);
+}
+
+void HTTPEngine::finishRequest(void *curl, int result)
+{
+	curl_multi_remove_handle(m_multi, curl);
+
+	MutexLock _(m_lock);
+	auto it = m_active.begin();
+	for (; it != m_active.end(); ++it) {
+		if (it->con->m_curl == curl)
+			break;
+	}
+	ASSERT(it != m_active.end(), "Unknown CURL handle");
+
+	if (it->cancelled) {
+		delete it->con;
+		m_active.erase(it);
+		return;
+	}
+
+	it->ok = it->con->finishTransfer(result);
+	m_done.splice(m_done.end(), m_active, it);
+	m_wake->notify();
+}
+
+void HTTPEngine::failAll()
+{
+	MutexLock _(m_lock);
+	if (m_active.empty() && m_new.empty())
+		return;
+
+	for (auto it = m_active.begin(); it != m_active.end();) {
+		curl_multi_remove_handle(m_multi, it->con->m_curl);
+		if (!it->cancelled) {
+			++it;
+			continue;
+		}
+
+		delete it->con;
+		it = m_active.erase(it);
+	}
+
+	// "ok" is still false for all of them
+	m_done.splice(m_done.end(), m_active);
+	m_done.splice(m_done.end(), m_new);
+	m_wake->notify();
+}
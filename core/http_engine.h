@@ -0,0 +1,64 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <functional>
+#include <list>
+
+class Connection;
+class WakeEvent;
+
+// Performs HTTP requests in a background thread using one curl multi handle.
+// Requests to the same host are multiplexed over a single HTTP/2 connection.
+// Completion callbacks are run by the client thread in processDone().
+
+class HTTPEngine {
+public:
+	// "ok": whether the transfer succeeded. The response is in "con".
+	// "con" is deleted after the callback returns.
+	typedef std::function<void(Connection *con, bool ok)> Callback;
+
+	HTTPEngine(WakeEvent *wake);
+	~HTTPEngine();
+	DISABLE_COPY(HTTPEngine);
+
+	// Takes ownership of "con", obtained from Connection::createHTTP
+	// "owner": any pointer to identify the requests on cancel()
+	// "cb": may be empty for requests without interest in the response
+	void enqueue(const void *owner, Connection *con, Callback && cb);
+	// Runs the callbacks of finished requests. Returns their count.
+	size_t processDone();
+	// Aborts all pending requests of "owner" without running the callbacks
+	void cancel(const void *owner);
+
+	// Amount of unfinished requests
+	size_t getPending() const;
+
+private:
+	struct Request {
+		const void *owner;
+		Connection *con;
+		Callback callback; // May be empty
+		bool ok = false;
+		bool cancelled = false;
+	};
+
+	static void *runAsync(void *engine);
+	void updateRequests();
+	void finishRequest(void *curl, int result);
+	// Ends all unfinished requests with ok = false
+	void failAll();
+
+	static const long MAX_HOST_CONNECTIONS = 4;
+	static const int POLL_TIMEOUT_MS = 1000;
+
+	WakeEvent *m_wake;
+	void *m_multi;
+	pthread_t m_thread = 0;
+	std::atomic<bool> m_running = true;
+
+	mutable std::mutex m_lock;
+	std::list<Request> m_new;    // Not yet handed to curl
+	std::list<Request> m_active; // In transfer
+	std::list<Request> m_done;   // Waiting for the callback
+};
@@ -16,6 +16,8 @@ struct UserIdBasic : IImplId {
 
 	bool is(const IImplId *other) const
 	{ return *nickptr == *((UserIdBasic *)other)->nickptr; }
+	size_t hash() const
+	{ return std::hash<std::string>()(*nickptr); }
 
 	std::string idStr() const { return *nickptr; }
 	std::string nameStr() const { return *nickptr; }
@@ -34,6 +36,8 @@ struct ChannelIdBasic : IImplId {
 
 	bool is(const IImplId *other) const
 	{ return name == ((ChannelIdBasic *)other)->name; }
+	size_t hash() const
+	{ return std::hash<std::string>()(name); }
 
 	std::string idStr() const { return name; }
 	std::string nameStr() const { return name; }
@@ -0,0 +1,295 @@
+#include "json_reader.h"
+#include <string.h> // strchr
+
+static void append_utf8(std::string &out, uint32_t cp)
+{
+	if (cp < 0x80) {
+		out.push_back(cp);
+	} else if (cp < 0x800) {
+		out.push_back(0xC0 | (cp >> 6));
+		out.push_back(0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		out.push_back(0xE0 | (cp >> 12));
+		out.push_back(0x80 | ((cp >> 6) & 0x3F));
+		out.push_back(0x80 | (cp & 0x3F));
+	} else {
+		out.push_back(0xF0 | (cp >> 18));
+		out.push_back(0x80 | ((cp >> 12) & 0x3F));
+		out.push_back(0x80 | ((cp >> 6) & 0x3F));
+		out.push_back(0x80 | (cp & 0x3F));
+	}
+}
+
+static bool parse_hex4(std::string_view str, uint32_t *out)
+{
+	if (str.size() < 4)
+		return false;
+
+	*out = 0;
+	for (int i = 0; i < 4; ++i) {
+		char c = str[i];
+		*out <<= 4;
+		if (c >= '0' && c <= '9')
+			*out |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			*out |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			*out |= c - 'A' + 10;
+		else
+			return false;
+	}
+	return true;
+}
+
+JsonReader::Token JsonReader::fail()
+{
+	m_string = std::string_view();
+	return m_token = JT_ERROR;
+}
+
+void JsonReader::skipSpaces()
+{
+	while (m_pos < m_data.size()) {
+		char c = m_data[m_pos];
+		if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+			break;
+		m_pos++;
+	}
+}
+
+JsonReader::Token JsonReader::next()
+{
+	if (m_token == JT_ERROR)
+		return JT_ERROR;
+
+	skipSpaces();
+	bool after_comma = false;
+	if (m_pos < m_data.size()) {
+		// Separators between the members or elements
+		char c = m_data[m_pos];
+		if (m_state == S_COLON) {
+			if (c != ':')
+				return fail();
+			m_state = S_VALUE;
+			m_pos++;
+			skipSpaces();
+		} else if (m_state == S_SEPARATOR && c == ',' && m_depth > 0) {
+			bool in_object = m_objects >> (m_depth - 1) & 1;
+			m_state = in_object ? S_KEY : S_VALUE;
+			after_comma = true;
+			m_pos++;
+			skipSpaces();
+		}
+	}
+
+	if (m_pos >= m_data.size()) {
+		if (m_depth == 0 && m_state == S_SEPARATOR)
+			return m_token = JT_END;
+		return fail();
+	}
+
+	char c = m_data[m_pos];
+	switch (c) {
+		case '{':
+		case '[':
+			if (m_state != S_VALUE || m_depth == MAX_DEPTH)
+				return fail();
+
+			m_objects &= ~(1ULL << m_depth);
+			if (c == '{')
+				m_objects |= 1ULL << m_depth;
+			m_depth++;
+			m_pos++;
+			m_state = (c == '{') ? S_KEY : S_VALUE;
+			return m_token = (c == '{') ? JT_OBJECT_BEGIN : JT_ARRAY_BEGIN;
+		case '}':
+		case ']':
+			if (m_depth == 0 || after_comma)
+				return fail();
+			if ((bool)(m_objects >> (m_depth - 1) & 1) != (c == '}'))
+				return fail();
+			if (m_state != S_SEPARATOR && m_state != (c == '}' ? S_KEY : S_VALUE))
+				return fail();
+
+			m_depth--;
+			m_pos++;
+			m_state = S_SEPARATOR;
+			return m_token = (c == '}') ? JT_OBJECT_END : JT_ARRAY_END;
+		case '"':
+			if (m_state != S_KEY && m_state != S_VALUE)
+				return fail();
+			if (!readStringToken())
+				return fail();
+			if (m_state == S_KEY) {
+				m_state = S_COLON;
+				return m_token = JT_KEY;
+			}
+			m_state = S_SEPARATOR;
+			return m_token = JT_STRING;
+		default:
+			break;
+	}
+
+	if (m_state != S_VALUE)
+		return fail();
+	m_state = S_SEPARATOR;
+
+	if (c == '-' || (c >= '0' && c <= '9')) {
+		size_t end = m_pos + 1;
+		while (end < m_data.size() && strchr("0123456789+-.eE", m_data[end]))
+			end++;
+
+		m_string = m_data.substr(m_pos, end - m_pos);
+		m_pos = end;
+		return m_token = JT_NUMBER;
+	}
+
+	static const struct {
+		const char *text;
+		Token token;
+	} literals[] = {
+		{ "true", JT_TRUE },
+		{ "false", JT_FALSE },
+		{ "null", JT_NULL }
+	};
+	for (const auto &l : literals) {
+		std::string_view text(l.text);
+		if (m_data.substr(m_pos, text.size()) == text) {
+			m_pos += text.size();
+			return m_token = l.token;
+		}
+	}
+	return fail();
+}
+
+bool JsonReader::readStringToken()
+{
+	size_t start = ++m_pos; // After '"'
+	size_t end = m_data.find_first_of("\"\\", start);
+	if (end == std::string_view::npos)
+		return false;
+
+	if (m_data[end] == '"') {
+		// No escape sequences: view into the document
+		m_string = m_data.substr(start, end - start);
+		m_pos = end + 1;
+		return true;
+	}
+
+	m_unescaped.assign(m_data.substr(start, end - start));
+	m_pos = end;
+	while (m_pos < m_data.size()) {
+		char c = m_data[m_pos++];
+		if (c == '"') {
+			m_string = m_unescaped;
+			return true;
+		}
+		if (c != '\\') {
+			m_unescaped.push_back(c);
+			continue;
+		}
+		if (m_pos >= m_data.size())
+			return false;
+
+		c = m_data[m_pos++];
+		switch (c) {
+			case '"':
+			case '\\':
+			case '/': m_unescaped.push_back(c); break;
+			case 'b': m_unescaped.push_back('\b'); break;
+			case 'f': m_unescaped.push_back('\f'); break;
+			case 'n': m_unescaped.push_back('\n'); break;
+			case 'r': m_unescaped.push_back('\r'); break;
+			case 't': m_unescaped.push_back('\t'); break;
+			case 'u': {
+				uint32_t cp;
+				if (!parse_hex4(m_data.substr(m_pos), &cp))
+					return false;
+				m_pos += 4;
+
+				if (cp >= 0xD800 && cp <= 0xDBFF) {
+					// UTF-16 surrogate pair
+					uint32_t low;
+					if (m_data.substr(m_pos, 2) != "\\u"
+							|| !parse_hex4(m_data.substr(m_pos + 2), &low)
+							|| low < 0xDC00 || low > 0xDFFF)
+						return false;
+					m_pos += 6;
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				}
+				append_utf8(m_unescaped, cp);
+				break;
+			}
+			default:
+				return false;
+		}
+	}
+	return false;
+}
+
+int64_t JsonReader::getInt() const
+{
+	int64_t value = 0;
+	bool negative = !m_string.empty() && m_string[0] == '-';
+	for (size_t i = negative ? 1 : 0; i < m_string.size(); ++i) {
+		char c = m_string[i];
+		if (c < '0' || c > '9')
+			break; // Fractional part
+		value = value * 10 + (c - '0');
+	}
+	return negative ? -value : value;
+}
+
+void JsonReader::skipCurrent()
+{
+	if (m_token != JT_OBJECT_BEGIN && m_token != JT_ARRAY_BEGIN)
+		return;
+
+	size_t depth = m_depth;
+	while (m_depth >= depth) {
+		Token t = next();
+		if (t == JT_ERROR || t == JT_END)
+			return;
+	}
+}
+
+bool JsonReader::skipValue()
+{
+	Token t = next();
+	if (t == JT_ERROR || t == JT_END || t == JT_OBJECT_END || t == JT_ARRAY_END)
+		return false;
+
+	skipCurrent();
+	return !hasError();
+}
+
+bool JsonReader::readInt(int64_t *out)
+{
+	if (next() != JT_NUMBER) {
+		skipCurrent();
+		return false;
+	}
+	*out = getInt();
+	return true;
+}
+
+bool JsonReader::readBool(bool *out)
+{
+	Token t = next();
+	if (t != JT_TRUE && t != JT_FALSE) {
+		skipCurrent();
+		return false;
+	}
+	*out = t == JT_TRUE;
+	return true;
+}
+
+bool JsonReader::readString(std::string *out)
+{
+	if (next() != JT_STRING) {
+		skipCurrent();
+		return false;
+	}
+	out->assign(m_string);
+	return true;
+}
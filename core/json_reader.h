@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+// Pull parser for JSON documents. No tree is built: the caller requests the
+// tokens one after another and skips the values it is not interested in.
+// Strings are returned as views, valid until the next call.
+
+class JsonReader {
+public:
+	enum Token {
+		JT_ERROR,
+		JT_END, // End of the document
+		JT_OBJECT_BEGIN,
+		JT_OBJECT_END,
+		JT_ARRAY_BEGIN,
+		JT_ARRAY_END,
+		JT_KEY, // Object member name. See getString()
+		JT_STRING,
+		JT_NUMBER,
+		JT_TRUE,
+		JT_FALSE,
+		JT_NULL
+	};
+
+	JsonReader(std::string_view data) :
+		m_data(data) {}
+
+	Token next();
+	bool hasError() const
+	{ return m_token == JT_ERROR; }
+
+	// Text of JT_KEY, JT_STRING and JT_NUMBER
+	std::string_view getString() const
+	{ return m_string; }
+	int64_t getInt() const;
+
+	// Consumes the next value, including nested objects and arrays
+	bool skipValue();
+
+	// Consume the next value. On type mismatch "out" is left unchanged
+	// and false is returned. Check hasError() for syntax errors.
+	bool readInt(int64_t *out);
+	bool readBool(bool *out);
+	bool readString(std::string *out);
+
+	// Calls "func(key)" for each member of the following object.
+	// "func" must consume the value and return false to abort.
+	template <typename F>
+	bool forEachMember(F &&func)
+	{
+		if (next() != JT_OBJECT_BEGIN) {
+			skipCurrent();
+			return false;
+		}
+
+		while (true) {
+			Token t = next();
+			if (t == JT_OBJECT_END)
+				return true;
+			if (t != JT_KEY || !func(m_string))
+				return false;
+		}
+	}
+
+	// Calls "func()" for each element of the following array
+	template <typename F>
+	bool forEachElement(F &&func)
+	{
+		if (next() != JT_ARRAY_BEGIN) {
+			skipCurrent();
+			return false;
+		}
+
+		while (true) {
+			// Look ahead for the end of the array
+			skipSpaces();
+			if (m_pos < m_data.size() && m_data[m_pos] == ']')
+				return next() == JT_ARRAY_END;
+			if (!func() || hasError())
+				return false;
+		}
+	}
+
+private:
+	// Skips the remainder of a just opened object or array
+	void skipCurrent();
+	void skipSpaces();
+	bool readStringToken();
+	Token fail();
+
+	// Nesting limit for the container stack below
+	static const size_t MAX_DEPTH = 64;
+
+	std::string_view m_data;
+	size_t m_pos = 0;
+	Token m_token = JT_END;
+	std::string_view m_string;
+	std::string m_unescaped; // Reused for strings with escape sequences
+
+	uint64_t m_objects = 0; // Bit per depth: 1 = object, 0 = array
+	size_t m_depth = 0;
+
+	// What may follow
+	enum State {
+		S_VALUE,
+		S_KEY,
+		S_COLON,
+		S_SEPARATOR // ',' or the end of the object or array
+	} m_state = S_VALUE;
+};
@@ -57,6 +57,11 @@ void IModule::addClientRequest(ClientRequest && cr)
 	m_client->addRequest(std::move(cr));
 }
 
+void IModule::enqueueHTTP(Connection *con, HTTPEngine::Callback && cb)
+{
+	m_client->getHTTPEngine()->enqueue(this, con, std::move(cb));
+}
+
 bool IModule::checkBotAdmin(Channel *c, UserInstance *ui, bool alert) const
 {
 	cstr_t &admin = getModuleMgr()->getGlobalSettings()->get("client.admin");
@@ -164,6 +169,8 @@ bool ModuleMgr::reloadModule(std::string name, bool keep_data)
 
 	Network *net = m_client ? m_client->getNetwork() : nullptr;
 	IModule *expired_ptr = mi->module;
+	// The module is deleted on unload: keep its slot to find the old data
+	size_t old_slot = expired_ptr->reserveContainerSlot();
 
 	unloadSingleModule(mi, keep_data);
 	bool ok = loadSingleModule(mi);
@@ -180,13 +187,15 @@ bool ModuleMgr::reloadModule(std::string name, bool keep_data)
 
 		auto &users = net->getAllUsers();
 		for (auto ui : users)
-			ui->move(expired_ptr, mi->module);
+			ui->move(old_slot, mi->module);
 
 		for (Channel *c : net->getAllChannels())
-			c->getContainers()->move(expired_ptr, mi->module);
+			c->getContainers()->move(old_slot, mi->module);
 
 		m_commands->move(expired_ptr, mi->module);
 	}
+	// Anything left behind is dropped as stale data
+	ContainerOwner::releaseContainerSlot(old_slot);
 
 	m_lock.unlock();
 	return ok;
@@ -286,7 +295,7 @@ void ModuleMgr::onStep(float time)
 	if (time <= 0.0f)
 		time = std::chrono::duration<float>(time_now - m_last_step).count();
 
-	if (time < 0.2f)
+	if (time < STEP_INTERVAL)
 		return;
 
 	m_last_step = time_now;
@@ -313,6 +322,13 @@ void ModuleMgr::onStep(float time)
 	}
 }
 
+float ModuleMgr::getStepDelay() const
+{
+	auto time_now = std::chrono::high_resolution_clock::now();
+	float elapsed = std::chrono::duration<float>(time_now - m_last_step).count();
+	return std::max(0.0f, STEP_INTERVAL - elapsed);
+}
+
 void ModuleMgr::onChannelJoin(Channel *c)
 {
 	MutexLock _(m_lock);
@@ -417,6 +433,10 @@ void ModuleInternal::unload(Network *net)
 	if (!module)
 		return;
 
+	// Pending callbacks would call into the unloaded library
+	if (module->m_client)
+		module->m_client->getHTTPEngine()->cancel(module);
+
 	if (net) {
 		// Remove this module data from all locations before the destructor turns invalid
 		for (Channel *c : net->getAllChannels()) {
@@ -2,7 +2,9 @@
 
 #include "clientrequest.h"
 #include "container.h"
+#include "http_engine.h"
 #include "types.h"
+#include <map>
 #include <set>
 
 #ifdef _WIN32
@@ -14,6 +16,7 @@
 
 class Channel;
 class ChatCommand;
+class Connection;
 class IClient;
 class ModuleMgr;
 class Network;
@@ -37,6 +40,8 @@ protected:
 	Network *getNetwork() const;
 	void sendRaw(cstr_t &what) const; // TODO: remove me
 	void addClientRequest(ClientRequest && cr);
+	// Performs "con" asynchronously. The callback runs in the main thread.
+	void enqueueHTTP(Connection *con, HTTPEngine::Callback && cb);
 	bool checkBotAdmin(Channel *c, UserInstance *ui, bool alert = true) const;
 
 	IClient *m_client = nullptr;
@@ -69,6 +74,8 @@ public:
 
 	// Callback handlers
 	void onStep(float time);
+	// Time in seconds until onStep(-1) runs the modules again
+	float getStepDelay() const;
 	void onChannelJoin(Channel *c);
 	void onChannelLeave(Channel *c);
 	void onUserJoin(Channel *c, UserInstance *ui);
@@ -83,6 +90,8 @@ private:
 	bool loadSingleModule(ModuleInternal *mi);
 	void unloadSingleModule(ModuleInternal *mi, bool keep_data = false);
 
+	static constexpr float STEP_INTERVAL = 0.2f;
+
 	std::chrono::high_resolution_clock::time_point m_last_step;
 	// Lock indicates whether the modules are currently in use
 	// do not change to ensure proper module reloading functionality
@@ -0,0 +1,98 @@
+#include "object_pool.h"
+#include "types.h"
+#include <new>
+
+// Block sizes are multiples of the alignment. Larger objects use the heap.
+static const size_t POOL_ALIGN = 16;
+static const size_t POOL_MAX_SIZE = 512;
+static const size_t POOL_NUM_BUCKETS = POOL_MAX_SIZE / POOL_ALIGN;
+// Memory is taken from the heap in chunks of this size
+static const size_t POOL_CHUNK_SIZE = 64 * 1024;
+
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+struct PoolState {
+	std::mutex lock;
+	FreeBlock *buckets[POOL_NUM_BUCKETS] = {};
+
+	// Remaining space of the current chunk
+	char *chunk_pos = nullptr;
+	size_t chunk_left = 0;
+	size_t reserved = 0;
+};
+
+static PoolState &get_pool()
+{
+	// Never freed: pooled objects might outlive the static data
+	static PoolState *pool = new PoolState();
+	return *pool;
+}
+
+static inline size_t get_bucket(size_t size)
+{
+	return (size + POOL_ALIGN - 1) / POOL_ALIGN - 1;
+}
+
+void *ObjectPool::allocate(size_t size)
+{
+	if (size == 0 || size > POOL_MAX_SIZE)
+		return ::operator new(size);
+
+	size_t bucket = get_bucket(size);
+	PoolState &pool = get_pool();
+	MutexLock _(pool.lock);
+
+	FreeBlock *block = pool.buckets[bucket];
+	if (block) {
+		pool.buckets[bucket] = block->next;
+		return block;
+	}
+
+	size_t block_size = (bucket + 1) * POOL_ALIGN;
+	if (pool.chunk_left < block_size) {
+		// Keep the rest of the old chunk as a smaller block
+		if (pool.chunk_left > 0) {
+			size_t rest_bucket = get_bucket(pool.chunk_left);
+			FreeBlock *rest = (FreeBlock *)pool.chunk_pos;
+			rest->next = pool.buckets[rest_bucket];
+			pool.buckets[rest_bucket] = rest;
+		}
+
+		pool.chunk_pos = (char *)::operator new(POOL_CHUNK_SIZE);
+		pool.chunk_left = POOL_CHUNK_SIZE;
+		pool.reserved += POOL_CHUNK_SIZE;
+	}
+
+	void *ptr = pool.chunk_pos;
+	pool.chunk_pos += block_size;
+	pool.chunk_left -= block_size;
+	return ptr;
+}
+
+void ObjectPool::release(void *ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	if (size == 0 || size > POOL_MAX_SIZE) {
+		::operator delete(ptr);
+		return;
+	}
+
+	PoolState &pool = get_pool();
+	MutexLock _(pool.lock);
+
+	size_t bucket = get_bucket(size);
+	FreeBlock *block = (FreeBlock *)ptr;
+	block->next = pool.buckets[bucket];
+	pool.buckets[bucket] = block;
+}
+
+size_t ObjectPool::getReservedBytes()
+{
+	PoolState &pool = get_pool();
+	MutexLock _(pool.lock);
+	return pool.reserved;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+// Recycles the memory of small, frequently created objects.
+// Released blocks are kept in free lists by size and never returned to the
+// heap, which avoids allocator pressure and fragmentation on long runs.
+
+namespace ObjectPool {
+	void *allocate(size_t size);
+	// "size" must match the size passed to allocate()
+	void release(void *ptr, size_t size);
+
+	// Bytes taken from the heap so far
+	size_t getReservedBytes();
+}
+
+// Base for classes which shall be allocated from the pool.
+// Polymorphic classes need a virtual destructor for the correct size.
+struct PoolAllocated {
+	static void *operator new(size_t size)
+	{ return ObjectPool::allocate(size); }
+
+	static void operator delete(void *ptr, size_t size)
+	{ ObjectPool::release(ptr, size); }
+};
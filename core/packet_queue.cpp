@@ -0,0 +1,70 @@
+#include "packet_queue.h"
+
+static size_t next_pow2(size_t n)
+{
+	size_t v = 1;
+	while (v < n)
+		v <<= 1;
+	return v;
+}
+
+PacketQueue::PacketQueue(size_t max_packets, size_t max_bytes) :
+	m_slots(next_pow2(max_packets)),
+	m_mask(m_slots.size() - 1),
+	m_max_bytes(max_bytes)
+{
+}
+
+bool PacketQueue::push(std::string_view data)
+{
+	const size_t tail = m_tail.load(std::memory_order_relaxed);
+	if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+		return false; // All slots in use
+
+	size_t bytes = m_bytes.load(std::memory_order_relaxed) + data.size();
+	if (bytes > m_max_bytes && !empty())
+		return false; // Too large. Always accept a single packet.
+
+	m_slots[tail & m_mask].assign(data);
+
+	m_bytes.fetch_add(data.size(), std::memory_order_relaxed);
+	if (bytes > m_high_water)
+		m_high_water = bytes;
+
+	m_tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+bool PacketQueue::pop(std::string &out)
+{
+	const size_t head = m_head.load(std::memory_order_relaxed);
+	if (head == m_tail.load(std::memory_order_acquire))
+		return false;
+
+	std::string &slot = m_slots[head & m_mask];
+	std::swap(slot, out);
+	slot.clear(); // Keeps the previous capacity of "out" for re-use
+
+	m_bytes.fetch_sub(out.size(), std::memory_order_relaxed);
+	m_head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+size_t PacketQueue::popBatch(std::vector<std::string> &out, size_t max)
+{
+	size_t head = m_head.load(std::memory_order_relaxed);
+	const size_t tail = m_tail.load(std::memory_order_acquire);
+	const size_t count = std::min(tail - head, max);
+
+	size_t bytes = 0;
+	out.reserve(out.size() + count);
+	for (size_t i = 0; i < count; ++i, ++head) {
+		out.emplace_back();
+		std::swap(out.back(), m_slots[head & m_mask]);
+		bytes += out.back().size();
+	}
+
+	m_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+	m_head.store(head, std::memory_order_release);
+	return count;
+}
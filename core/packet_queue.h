@@ -0,0 +1,47 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <string_view>
+#include <vector>
+
+// Bounded lock-free ring buffer for exactly one producer thread and one
+// consumer thread. The limits apply to the packet count and summed size.
+
+class PacketQueue {
+public:
+	PacketQueue(size_t max_packets, size_t max_bytes);
+	DISABLE_COPY(PacketQueue);
+
+	// Producer: Returns false if the packet does not fit
+	bool push(std::string_view data);
+
+	// Consumer: "out" is swapped with the queue entry
+	bool pop(std::string &out);
+	// Consumer: Appends up to "max" packets to "out". Returns the count.
+	size_t popBatch(std::vector<std::string> &out, size_t max = SIZE_MAX);
+
+	bool empty() const
+	{ return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire); }
+	size_t getBytes() const
+	{ return m_bytes.load(std::memory_order_relaxed); }
+
+	void setMaxBytes(size_t max_bytes)
+	{ m_max_bytes = max_bytes; }
+	// Highest amount of queued bytes so far
+	size_t getHighWaterMark() const
+	{ return m_high_water; }
+
+private:
+	std::vector<std::string> m_slots;
+	const size_t m_mask;
+
+	// Read index, written by the consumer
+	alignas(64) std::atomic<size_t> m_head { 0 };
+	// Write index, written by the producer
+	alignas(64) std::atomic<size_t> m_tail { 0 };
+
+	std::atomic<size_t> m_bytes { 0 };
+	std::atomic<size_t> m_max_bytes;
+	size_t m_high_water = 0;
+};
@@ -91,6 +91,20 @@ bool strequalsi(const std::string &a, const std::string &b)
 	return true;
 }
 
+std::string casefold(const std::string &text, CaseMapping cm)
+{
+	const char last_special = cm == CM_RFC1459 ? '^' : ']';
+
+	std::string out(text);
+	for (char &c : out) {
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		else if (cm != CM_ASCII && c >= '[' && c <= last_special)
+			c += '{' - '[';
+	}
+	return out;
+}
+
 size_t strfindi(std::string haystack, std::string needle)
 {
 	for (char &c : haystack)
@@ -211,6 +225,77 @@ std::string base64decode(const void *data, size_t len)
     return result;
 }
 
+// SHA-1 (RFC 3174), needed for the WebSocket handshake
+
+static inline uint32_t rotl32(uint32_t v, int n)
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+static void sha1_block(uint32_t *h, const uint8_t *block)
+{
+	uint32_t w[80];
+	for (int i = 0; i < 16; ++i) {
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+			| (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	}
+	for (int i = 16; i < 80; ++i)
+		w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for (int i = 0; i < 80; ++i) {
+		uint32_t f, k;
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		uint32_t temp = rotl32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rotl32(b, 30);
+		b = a;
+		a = temp;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+std::string sha1(const void *data, size_t len)
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	const uint8_t *p = (const uint8_t *)data;
+
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64)
+		sha1_block(h, &p[i]);
+
+	// Padding: 0x80, zeros, message length in bits
+	uint8_t block[128] = { 0 };
+	size_t rest = len - i;
+	memcpy(block, &p[i], rest);
+	block[rest] = 0x80;
+	size_t blocks = (rest + 9 > 64) ? 2 : 1;
+	uint64_t bits = (uint64_t)len * 8;
+	for (int j = 0; j < 8; ++j)
+		block[blocks * 64 - 1 - j] = bits >> (j * 8);
+
+	for (size_t j = 0; j < blocks; ++j)
+		sha1_block(h, &block[j * 64]);
+
+	std::string result(20, '\0');
+	for (int j = 0; j < 20; ++j)
+		result[j] = h[j / 4] >> (24 - (j % 4) * 8);
+	return result;
+}
+
 IFormatter::IFormatter()
 {
 	m_os = new std::stringstream();
@@ -15,6 +15,15 @@ std::string get_next_part(std::string &input);
 bool is_yes(std::string what);
 // Case-insentitive string compare
 bool strequalsi(const std::string &a, const std::string &b);
+
+// Rules for case-insensitive nicknames. IRC: ISUPPORT CASEMAPPING
+enum CaseMapping {
+	CM_ASCII,
+	CM_RFC1459,       // Also "[]\^" equals "{}|~"
+	CM_STRICT_RFC1459 // Also "[]\" equals "{}|"
+};
+// Returns the lowercase representation
+std::string casefold(const std::string &text, CaseMapping cm);
 // Case-insensitive string search
 size_t strfindi(std::string haystack, std::string needle);
 
@@ -37,6 +46,9 @@ enum IRC_Color {
 std::string base64encode(const void *data, size_t len);
 std::string base64decode(const void *data, size_t len);
 
+// Returns the 20 bytes long binary digest
+std::string sha1(const void *data, size_t len);
+
 
 typedef uint16_t FormatType;
 enum : uint16_t {
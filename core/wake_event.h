@@ -0,0 +1,36 @@
+#pragma once
+
+#include "types.h"
+#include <condition_variable>
+
+// Lets a thread sleep until another thread signals new work
+
+class WakeEvent {
+public:
+	WakeEvent() = default;
+	DISABLE_COPY(WakeEvent);
+
+	void notify()
+	{
+		{
+			MutexLock _(m_lock);
+			m_pending = true;
+		}
+		m_cv.notify_one();
+	}
+
+	// Returns 'true' when woken up by notify(), 'false' on timeout
+	bool wait(float max_seconds)
+	{
+		MutexLock lock(m_lock);
+		bool woken = m_cv.wait_for(lock, std::chrono::duration<float>(max_seconds),
+			[this] { return m_pending; });
+		m_pending = false;
+		return woken;
+	}
+
+private:
+	std::mutex m_lock;
+	std::condition_variable m_cv;
+	bool m_pending = false;
+};
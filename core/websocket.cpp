@@ -0,0 +1,296 @@
+#include "websocket.h"
+#include "logger.h"
+#include <random>
+#include <string.h> // memcpy
+#include <zlib.h>
+
+// Largest HTTP response header to accept during the upgrade
+static const size_t HEADER_MAX = 16 * 1024;
+// Output chunk size of the inflater
+static const size_t INFLATE_CHUNK = 16 * 1024;
+
+WebSocketCodec::WebSocketCodec(size_t initial_size, size_t max_size) :
+	m_size(initial_size), m_max_size(max_size)
+{
+	m_data.reset(new char[m_size]);
+}
+
+WebSocketCodec::~WebSocketCodec()
+{
+	if (m_zstream) {
+		inflateEnd(m_zstream);
+		delete m_zstream;
+	}
+}
+
+char *WebSocketCodec::prepareWrite(size_t *size)
+{
+	if (m_begin == m_end) {
+		// Everything consumed. Start over.
+		m_begin = m_end = 0;
+	}
+
+	size_t pending = m_end - m_begin;
+	if (m_needed > m_size || (pending == m_size && m_size < m_max_size)) {
+		// The incomplete frame does not fit
+		size_t new_size = std::min(std::max(m_size * 2, m_needed), m_max_size);
+		char *data = new char[new_size];
+		memcpy(data, &m_data[m_begin], pending);
+		m_data.reset(data);
+		m_size = new_size;
+		m_end = pending;
+		m_begin = 0;
+	} else if (m_begin > 0 && (m_end > m_size / 2 || m_begin + m_needed > m_size)) {
+		// Move the incomplete frame to the front
+		memmove(&m_data[0], &m_data[m_begin], pending);
+		m_end = pending;
+		m_begin = 0;
+	}
+
+	*size = m_size - m_end;
+	return &m_data[m_end];
+}
+
+void WebSocketCodec::commitWrite(size_t nread)
+{
+	m_end += nread;
+}
+
+bool WebSocketCodec::popHeader(std::string_view *header)
+{
+	std::string_view data(&m_data[m_begin], m_end - m_begin);
+	size_t pos = data.find("\r\n\r\n");
+	if (pos == std::string_view::npos) {
+		if (data.size() > HEADER_MAX)
+			m_error = true;
+		return false;
+	}
+
+	*header = data.substr(0, pos + 4);
+	m_begin += pos + 4;
+	return true;
+}
+
+bool WebSocketCodec::popFrame(WebSocketFrame *frame)
+{
+	if (m_error)
+		return false;
+
+	const uint8_t *data = (const uint8_t *)&m_data[m_begin];
+	size_t available = m_end - m_begin;
+	if (available < 2)
+		return false;
+
+	frame->fin = data[0] & 0x80;
+	frame->compressed = data[0] & 0x40;
+	frame->opcode = data[0] & 0x0F;
+	bool masked = data[1] & 0x80;
+	uint64_t length = data[1] & 0x7F;
+
+	size_t header_size = 2;
+	if (length == 126) {
+		header_size = 4;
+		if (available < header_size)
+			return false;
+		length = (uint64_t)data[2] << 8 | data[3];
+	} else if (length == 127) {
+		header_size = 10;
+		if (available < header_size)
+			return false;
+		length = 0;
+		for (int i = 0; i < 8; ++i)
+			length = length << 8 | data[2 + i];
+	}
+	if (masked)
+		header_size += 4;
+
+	bool is_control = frame->opcode & 0x08;
+	if ((data[0] & 0x30) || (frame->compressed && (!m_zstream || is_control))) {
+		WARN("Invalid frame flags: " << (int)data[0]);
+		m_error = true;
+		return false;
+	}
+	if (is_control && (!frame->fin || length > 125)) {
+		WARN("Invalid control frame");
+		m_error = true;
+		return false;
+	}
+	if (length > m_max_size - header_size) {
+		WARN("Frame exceeds " << m_max_size << " bytes");
+		m_error = true;
+		return false;
+	}
+
+	m_needed = header_size + length;
+	if (available < m_needed)
+		return false;
+
+	char *payload = &m_data[m_begin + header_size];
+	if (masked) {
+		const uint8_t *key = &data[header_size - 4];
+		for (size_t i = 0; i < length; ++i)
+			payload[i] ^= key[i & 3];
+	}
+
+	frame->payload = std::string_view(payload, length);
+	m_begin += m_needed;
+	m_needed = 0;
+	return true;
+}
+
+bool WebSocketCodec::popMessage(WebSocketFrame *msg)
+{
+	if (m_message_done) {
+		m_message.clear();
+		m_message_done = false;
+	}
+
+	WebSocketFrame frame;
+	while (popFrame(&frame)) {
+		if (frame.opcode & 0x08) {
+			// Control frames may be sent in between fragments
+			*msg = frame;
+			return true;
+		}
+
+		if (frame.opcode == WebSocketFrame::OP_CONTINUATION) {
+			if (m_message_opcode == 0) {
+				WARN("Unexpected continuation frame");
+				m_error = true;
+				return false;
+			}
+		} else {
+			if (m_message_opcode != 0) {
+				WARN("Expected continuation frame");
+				m_error = true;
+				return false;
+			}
+
+			if (frame.fin && !frame.compressed) {
+				// Unfragmented: no copy needed
+				*msg = frame;
+				return true;
+			}
+			m_message_opcode = frame.opcode;
+			m_message_compressed = frame.compressed;
+		}
+
+		if (m_message.size() + frame.payload.size() > m_max_size) {
+			WARN("Message exceeds " << m_max_size << " bytes");
+			m_error = true;
+			return false;
+		}
+		m_message.append(frame.payload);
+
+		if (!frame.fin)
+			continue;
+
+		msg->opcode = m_message_opcode;
+		msg->fin = true;
+		msg->compressed = false;
+		msg->payload = m_message;
+		m_message_opcode = 0;
+		m_message_done = true;
+
+		if (m_message_compressed) {
+			if (!inflate(m_message))
+				return false;
+			msg->payload = m_inflated;
+		}
+		return true;
+	}
+	return false;
+}
+
+void WebSocketCodec::enableDeflate(bool context_takeover)
+{
+	if (m_zstream)
+		return;
+
+	m_zstream = new z_stream();
+	memset(m_zstream, 0, sizeof(z_stream));
+	// Raw deflate data without zlib header
+	if (inflateInit2(m_zstream, -MAX_WBITS) != Z_OK) {
+		ERROR("inflateInit2 failed");
+		delete m_zstream;
+		m_zstream = nullptr;
+		return;
+	}
+	m_context_takeover = context_takeover;
+}
+
+bool WebSocketCodec::inflate(std::string_view in)
+{
+	// RFC 7692: the sender removed the trailing empty block
+	static const uint8_t TAIL[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+	m_inflated.clear();
+	for (int part = 0; part < 2; ++part) {
+		m_zstream->next_in = part == 0 ? (Bytef *)in.data() : (Bytef *)TAIL;
+		m_zstream->avail_in = part == 0 ? in.size() : sizeof(TAIL);
+
+		do {
+			size_t old_size = m_inflated.size();
+			if (old_size + INFLATE_CHUNK > m_max_size) {
+				WARN("Inflated message exceeds " << m_max_size << " bytes");
+				m_error = true;
+				return false;
+			}
+			m_inflated.resize(old_size + INFLATE_CHUNK);
+			m_zstream->next_out = (Bytef *)&m_inflated[old_size];
+			m_zstream->avail_out = INFLATE_CHUNK;
+
+			int status = ::inflate(m_zstream, Z_SYNC_FLUSH);
+			m_inflated.resize(old_size + INFLATE_CHUNK - m_zstream->avail_out);
+
+			if (status == Z_STREAM_END) {
+				// Final block. Continue with a new stream.
+				inflateReset(m_zstream);
+			} else if (status == Z_BUF_ERROR) {
+				break; // No progress possible
+			} else if (status != Z_OK) {
+				WARN("inflate failed: " << status);
+				m_error = true;
+				return false;
+			}
+		} while (m_zstream->avail_in > 0 || m_zstream->avail_out == 0);
+	}
+
+	if (!m_context_takeover)
+		inflateReset(m_zstream);
+	return true;
+}
+
+void WebSocketCodec::encodeFrame(uint8_t opcode, std::string_view payload, std::string *out)
+{
+	// RFC 6455, section 5.3: the masking key must be unpredictable
+	static thread_local std::random_device rng;
+
+	size_t length = payload.size();
+	out->clear();
+	out->reserve(length + 14);
+	out->push_back(0x80 | opcode); // FIN
+
+	// Client frames are always masked
+	if (length < 126) {
+		out->push_back(0x80 | length);
+	} else if (length < 0x10000) {
+		out->push_back(0x80 | 126);
+		out->push_back(length >> 8);
+		out->push_back(length & 0xFF);
+	} else {
+		out->push_back(0x80 | 127);
+		for (int i = 7; i >= 0; --i)
+			out->push_back((uint64_t)length >> (i * 8));
+	}
+
+	uint32_t mask = rng();
+	uint8_t key[4];
+	memcpy(key, &mask, 4);
+	out->append((const char *)key, 4);
+
+	size_t offset = out->size();
+	out->append(payload);
+	for (size_t i = 0; i < length; ++i)
+		(*out)[offset + i] ^= key[i & 3];
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "types.h"
+#include <memory> // unique_ptr
+#include <string_view>
+
+struct z_stream_s;
+
+// RFC 6455 frame or message
+struct WebSocketFrame {
+	enum Opcode : uint8_t {
+		OP_CONTINUATION = 0x0,
+		OP_TEXT   = 0x1,
+		OP_BINARY = 0x2,
+		OP_CLOSE  = 0x8,
+		OP_PING   = 0x9,
+		OP_PONG   = 0xA
+	};
+
+	uint8_t opcode;
+	bool fin;
+	bool compressed; // RSV1: permessage-deflate
+	std::string_view payload;
+};
+
+// Receive buffer which splits the data into frames and messages.
+// Payloads are unmasked in place and returned as views into the buffer.
+class WebSocketCodec {
+public:
+	WebSocketCodec(size_t initial_size, size_t max_size);
+	~WebSocketCodec();
+	DISABLE_COPY(WebSocketCodec);
+
+	// Returns the space to receive new data into
+	char *prepareWrite(size_t *size);
+	void commitWrite(size_t nread);
+
+	// HTTP upgrade response, including the terminating empty line
+	bool popHeader(std::string_view *header);
+	// Returns a control frame or a complete (reassembled, inflated) message.
+	// The payload is valid until the next call or write.
+	bool popMessage(WebSocketFrame *msg);
+
+	// Protocol error or size limit exceeded. The connection must be closed.
+	bool hasError() const
+	{ return m_error; }
+	// Decompress messages sent with RSV1 (permessage-deflate)
+	void enableDeflate(bool context_takeover);
+
+	// Client-to-server frame, masked with a random key
+	static void encodeFrame(uint8_t opcode, std::string_view payload, std::string *out);
+
+private:
+	bool popFrame(WebSocketFrame *frame);
+	bool inflate(std::string_view in);
+
+	std::unique_ptr<char[]> m_data;
+	size_t m_size;
+	const size_t m_max_size;
+	size_t m_begin = 0;  // First unconsumed byte
+	size_t m_end = 0;    // End of the received data
+	size_t m_needed = 0; // Size of the incomplete frame at m_begin
+	bool m_error = false;
+
+	// Fragmented message in reassembly
+	std::string m_message;
+	uint8_t m_message_opcode = 0;
+	bool m_message_compressed = false;
+	bool m_message_done = false;
+
+	// permessage-deflate
+	z_stream_s *m_zstream = nullptr;
+	bool m_context_takeover = true;
+	std::string m_inflated;
+};
@@ -111,7 +111,7 @@ DLL_EXPORT int main(int argc, char *argv[])
 
 		while (keep_running && s_cli->run()) {
 			s_cli->processRequests();
-			SLEEP_MS(20);
+			s_cli->waitForWork();
 		}
 	}
 	return 0;
@@ -7,8 +7,26 @@
 #include "utils.h"
 //#include <fstream>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <pugixml.hpp>
+#include <set>
+
+struct FeedEntry {
+	std::string title;
+	std::string link;
+	std::string author;
+	time_t timestamp;
+};
+
+// Parsed feed contents, shared by all subscribed channels
+struct FeedCache {
+	// Conditional request validators of the last response
+	std::string etag;
+	std::string last_modified;
+
+	std::vector<FeedEntry> entries; // in document order
+};
 
 struct Feeds : public IContainer {
 	std::string dump() const { return "Feeds"; }
@@ -24,6 +42,13 @@ struct Feeds : public IContainer {
 	std::map<std::string, time_t> last_update;
 };
 
+struct FeedJob {
+	std::string url;
+	// Test of a newly added feed. nullptr if the channel was left
+	Channel *c;
+	std::string key;
+};
+
 class nbm_feeds : public IModule {
 public:
 	~nbm_feeds()
@@ -51,24 +76,52 @@ public:
 			return;
 		timer -= 30 * 60;
 
-		size_t count = 0;
+		if (m_check_count > 0) {
+			WARN("Previous feed check is still running");
+			return;
+		}
+
+		// Each URL is downloaded once, regardless of the subscriber count
+		std::set<std::string> urls;
 		for (Channel *c : getNetwork()->getAllChannels()) {
 			Feeds *f = getFeedsOrCreate(c);
+			if (!f)
+				continue;
 
 			// Iterate through all registered feeds
 			auto keys = f->settings->getKeys();
-			for (cstr_t &key : keys) {
-				const char *err = notifySingle(c, key, f);
-				if (err)
-					WARN(err);
-				count++;
-			}
+			for (cstr_t &key : keys)
+				urls.insert(f->settings->get(key));
+		}
+
+		// Forget unsubscribed feeds
+		for (auto it = m_cache.begin(); it != m_cache.end();) {
+			if (urls.find(it->first) == urls.end())
+				it = m_cache.erase(it);
+			else
+				++it;
 		}
-		LOG("Feed check completed (" << count << " feeds)");
+
+		for (cstr_t &url : urls) {
+			m_queued.push_back(FeedJob { url, nullptr, "" });
+			m_check_count++;
+		}
+		startFetches();
 	}
 
 	void onChannelLeave(Channel *c)
 	{
+		for (auto it = m_queued.begin(); it != m_queued.end();) {
+			if (it->c == c)
+				it = m_queued.erase(it);
+			else
+				++it;
+		}
+		for (FeedJob &job : m_active) {
+			if (job.c == c)
+				job.c = nullptr;
+		}
+
 		c->getContainers()->remove(this);
 	}
 
@@ -87,20 +140,95 @@ public:
 		return f;
 	}
 
-	const char *notifySingle(Channel *c, cstr_t &key, Feeds *f)
+	// Downloads the queued feeds in parallel
+	void startFetches()
 	{
-#if 1
-		cstr_t &url = f->settings->get(key);
-		if (url.empty())
-			return "Invalid request. Empty URL.";
+		while (m_active.size() < MAX_ACTIVE_FETCHES && !m_queued.empty()) {
+			m_active.splice(m_active.end(), m_queued, m_queued.begin());
+			auto it = std::prev(m_active.end());
+
+			if (it->url.empty()) {
+				onFetchDone(*it, "Invalid request. Empty URL.");
+				m_active.erase(it);
+				continue;
+			}
+
+			Connection *con = Connection::createHTTP("GET", it->url);
+
+			// Unchanged feeds are answered with "304 Not Modified"
+			auto cache = m_cache.find(it->url);
+			if (cache != m_cache.end()) {
+				if (!cache->second.etag.empty())
+					con->addHTTP_Header("If-None-Match: " + cache->second.etag);
+				if (!cache->second.last_modified.empty())
+					con->addHTTP_Header("If-Modified-Since: " + cache->second.last_modified);
+			}
+
+			enqueueHTTP(con, [this, it] (Connection *con, bool ok) {
+				const char *err = updateCache(it->url, ok ? con : nullptr, getCutoff(it->url));
+				onFetchDone(*it, err);
+				m_active.erase(it);
+				startFetches();
+			});
+		}
+	}
+
+	void onFetchDone(const FeedJob &job, const char *err)
+	{
+		if (!job.key.empty()) {
+			// Feed test
+			if (!job.c)
+				return;
+
+			Feeds *f = getFeedsOrCreate(job.c);
+			if (err) {
+				job.c->say("Feed test failed: " + std::string(err));
+				f->settings->remove(job.key);
+			} else {
+				notifySingle(job.c, job.key, m_cache[job.url]);
+				job.c->say("Added feed " + job.key + "!");
+			}
+			f->settings->syncFileContents(SR_WRITE);
+			return;
+		}
+
+		// Fan out to all subscribers
+		for (Channel *c : getNetwork()->getAllChannels()) {
+			Feeds *f = getFeedsOrCreate(c);
+			if (!f)
+				continue;
+
+			auto keys = f->settings->getKeys();
+			for (cstr_t &key : keys) {
+				if (f->settings->get(key) != job.url)
+					continue;
+
+				if (err)
+					f->last_update.erase(key);
+				else
+					notifySingle(c, key, m_cache[job.url]);
+			}
+		}
+
+		if (err)
+			WARN(err << ": " << job.url);
+
+		if (m_check_count > 0 && --m_check_count == 0)
+			LOG("Feed check completed (" << m_cache.size() << " feeds)");
+	}
 
-		// Download feed, analyze
-		std::unique_ptr<Connection> con(Connection::createHTTP("GET", url));
-		con->connect();
+	// con: finished transfer, or nullptr on failure
+	// cutoff: see getCutoff()
+	const char *updateCache(cstr_t &url, Connection *con, time_t cutoff)
+	{
+#if 1
+		long status = con ? con->getHTTP_Status() : 0;
+		if (status == 304 && m_cache.count(url))
+			return nullptr; // Not modified
 
-		std::unique_ptr<std::string> text(con->popAll());
-		if (!text) {
-			f->last_update.erase(key);
+		std::unique_ptr<std::string> text(con ? con->popAll() : nullptr);
+		if (!text || status != 200) {
+			m_cache.erase(url);
 			return "File download failed";
 		}
 
@@ -114,9 +242,103 @@ public:
 
 		if (!result) {
 			WARN("XML parser failed: " << result.description());
+			m_cache.erase(url);
 			return "XML parser failed";
 		}
 
+		// Atom or RSS 2.0
+		bool is_rss = false;
+		pugi::xml_node root = doc.select_node(m_query_atom).node();
+		if (!root) {
+			root = doc.select_node(m_query_rss).node();
+			is_rss = true;
+		}
+
+		FeedCache &cache = m_cache[url];
+		cache.etag = con->getHTTP_ResponseHeader("ETag");
+		cache.last_modified = con->getHTTP_ResponseHeader("Last-Modified");
+		cache.entries.clear();
+
+		// Entries are sorted by date, newest first
+		for (pugi::xml_node node : root.children(is_rss ? "item" : "entry")) {
+			FeedEntry entry;
+			entry.title = strtrim(node.child_value("title"));
+			const char *date;
+			bool ok;
+
+			if (is_rss) {
+				entry.link = node.child_value("link");
+				entry.author = node.child_value("author");
+				if (entry.author.empty())
+					entry.author = node.child_value("dc:creator");
+				date = node.child_value("pubDate");
+				// "Mon, 01 Jan 2024 12:00:00 +0000", or "GMT" suffix
+				ok = parse_time(date, "%a, %d %b %Y %T %z", &entry.timestamp)
+					|| parse_time(date, "%a, %d %b %Y %T", &entry.timestamp);
+			} else {
+				entry.link = node.child("link").attribute("href").as_string();
+				entry.author = node.child("author").child_value("name");
+				date = node.child_value("updated");
+				// "2024-01-01T12:00:00Z" or "2024-01-01T12:00:00+02:00"
+				ok = parse_time(date, "%FT%T%z", &entry.timestamp);
+			}
+
+			if (!ok) {
+				VERBOSE("Invalid date: " << entry.title << " date=" << date);
+				continue; // Invalid date
+			}
+
+			bool is_old = entry.timestamp <= cutoff;
+			cache.entries.emplace_back(std::move(entry));
+
+			// No subscriber needs the remaining entries
+			if (is_old || cutoff < 0)
+				break;
+		}
+
+		if (cache.entries.empty()) {
+			m_cache.erase(url);
+			return "Cannot find any feed entries";
+		}
+
+		return nullptr;
+	}
+
+	// Date format to UTC timestamp
+	static bool parse_time(const char *str, const char *format, time_t *out)
+	{
+		tm timeinfo {};
+		if (!strptime(str, format, &timeinfo))
+			return false;
+
+		*out = timegm(&timeinfo) - timeinfo.tm_gmtoff;
+		return true;
+	}
+
+	// Oldest timestamp that is still of interest. -1 if only the newest entry is.
+	time_t getCutoff(cstr_t &url)
+	{
+		time_t cutoff = -1;
+		for (Channel *c : getNetwork()->getAllChannels()) {
+			Feeds *f = getFeedsOrCreate(c);
+			if (!f)
+				continue;
+
+			for (auto &it : f->last_update) {
+				if (f->settings->get(it.first) != url)
+					continue;
+
+				if (cutoff < 0 || it.second < cutoff)
+					cutoff = it.second;
+			}
+		}
+		return cutoff;
+	}
+
+	void notifySingle(Channel *c, cstr_t &key, const FeedCache &cache)
+	{
+		Feeds *f = getFeedsOrCreate(c);
+
 		time_t last_check = 0;
 		{
 			auto it = f->last_update.find(key);
@@ -125,29 +347,13 @@ public:
 		}
 		time_t time_newest = last_check;
 
-		auto nodes = doc.select_nodes("/feed/entry");
-		if (nodes.empty())
-			return "Cannot find any feed entries";
-
 		int msg_limit = 3;
-		for (auto &it : nodes) {
-			std::string title(strtrim(it.node().child_value("title")));
-			auto link = it.node().child("link").attribute("href").as_string();
-			auto author = it.node().child("author").child_value("name");
-			auto date = it.node().child_value("updated");
-
-			tm timeinfo;
-			if (!strptime(date, "%FT%TZ", &timeinfo)) {
-				VERBOSE("Invalid date: " << title << " date=" << date);
-				continue; // Invalid date
-			}
-
-			time_t timestamp = mktime(&timeinfo);
-			if (timestamp <= last_check)
+		for (const FeedEntry &entry : cache.entries) {
+			if (entry.timestamp <= last_check)
 				continue; // Skip old information
 
-			if (timestamp > time_newest)
-				time_newest = timestamp;
+			if (entry.timestamp > time_newest)
+				time_newest = entry.timestamp;
 
 			if (last_check == 0) {
 				// Init cycle. Update to newest timestamp
@@ -159,22 +365,22 @@ public:
 				break; // Rate limit
 			}
 
-			auto parts = strsplit(link, '/');
+			// "https://github.com/USER/PROJECT/..."
+			auto parts = strsplit(entry.link, '/');
+			cstr_t &project = parts.size() > 3 ? parts[3] : key;
 			// AUTHOR @PROJECTNAME: COMMIT MESSAGE
 			auto *fmt = c->createFormatter();
 
-			fmt->begin(IC_GREEN); *fmt << author; fmt->end(FT_COLOR);
+			fmt->begin(IC_GREEN); *fmt << entry.author; fmt->end(FT_COLOR);
 			*fmt << " @";
-			fmt->begin(IC_MAROON); *fmt << parts[3]; fmt->end(FT_COLOR);
+			fmt->begin(IC_MAROON); *fmt << project; fmt->end(FT_COLOR);
 			*fmt << ": ";
-			fmt->begin(IC_LIGHT_GRAY); *fmt << title; fmt->end(FT_COLOR);
+			fmt->begin(IC_LIGHT_GRAY); *fmt << entry.title; fmt->end(FT_COLOR);
 	
 			c->say(fmt->str());
 			delete fmt;
 		}
 		f->last_update[key] = time_newest;
-
-		return nullptr;
 	}
 
 	CHATCMD_FUNC(cmd_help)
@@ -214,17 +420,13 @@ public:
 			return;
 		}
 
-		f->settings->set(key, strtrim(msg));
+		std::string url(strtrim(msg));
+		f->settings->set(key, url);
+		f->last_update.erase(key);
 
-		// Test it.
-		const char *err = notifySingle(c, key, f);
-		if (err) {
-			c->say("Feed test failed: " + std::string(err));
-			f->settings->remove(key);
-		} else {
-			c->reply(ui, "Added!");
-		}
-		f->settings->syncFileContents(SR_WRITE);
+		// Test it. The result is reported once downloaded.
+		m_queued.push_front(FeedJob { url, c, key });
+		startFetches();
 	}
 
 	CHATCMD_FUNC(cmd_remove)
@@ -244,9 +446,19 @@ public:
 	}
 
 private:
+	static const size_t MAX_ACTIVE_FETCHES = 4;
+
 	ChatCommand *m_commands = nullptr;
 	Settings *m_settings = nullptr;
 	float timer = 0;
+
+	const pugi::xpath_query m_query_atom { "/feed" };
+	const pugi::xpath_query m_query_rss { "/rss/channel" };
+
+	std::map<std::string, FeedCache> m_cache; // key: URL
+	std::list<FeedJob> m_queued;
+	std::list<FeedJob> m_active; // Downloading
+	size_t m_check_count = 0; // Remaining feeds of the periodic check
 };
 
 
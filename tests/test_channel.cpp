@@ -45,28 +45,74 @@ void test_Network_Channel_UserInstance()
 
 		TEST_CHECK(c->getUser("Mickey") == nullptr);
 		UserInstance *ui_m = c->addUser(UserIdBasic("Mickey"));
+		TEST_CHECK(ui_m->getChannels().size() == 1 && ui_m->getChannels()[0] == c);
 		TEST_CHECK(c->getUser("miCKey") == ui_m);
 		ui_m->set(nullptr, new RefContainer());
 
 		TEST_CHECK(c->removeUser(ui_m) == true);
+		TEST_CHECK(ui_m->getChannels().empty());
 		// Reference is still held by Network
 		TEST_CHECK(instances == 2);
 		TEST_CHECK(c->getUser("Mickey") == nullptr);
 		// Drop from Network -> reference gone
 		TEST_CHECK(n.removeUser(ui_m) == true);
 		TEST_CHECK(instances == 1);
+
+		// ID lookup after a nickname change
+		n.renameUser(ui_d, "Daisy");
+		TEST_CHECK(c->getUser(UserIdBasic("Donald")) == nullptr);
+		TEST_CHECK(c->getUser(UserIdBasic("Daisy")) == ui_d);
+		TEST_CHECK(n.getUser(UserIdBasic("Daisy")) == ui_d);
+		TEST_CHECK(c->getUser("donald") == nullptr);
+		TEST_CHECK(c->getUser("DAISY") == ui_d);
+
+		// IRC case mapping
+		UserInstance *ui_x = c->addUser(UserIdBasic("X[a]^"));
+		TEST_CHECK(c->getUser("x[A]^") == ui_x);
+		TEST_CHECK(c->getUser("x{a}~") == nullptr);
+		client->setCaseMapping(CM_RFC1459);
+		TEST_CHECK(c->getUser("x{a}~") == ui_x);
+		client->setCaseMapping(CM_ASCII);
+		TEST_CHECK(n.removeUser(ui_x) == true);
 	}
 
 	TEST_CHECK(n.removeChannel(c) == true);
 	c = nullptr;
 
 	TEST_CHECK(n.getAllChannels().size() == 0);
-	TEST_CHECK(n.getUser("Donald") == nullptr);
+	TEST_CHECK(n.getChannel(ChannelIdBasic("#foobar")) == nullptr);
+	TEST_CHECK(n.getUser("Daisy") == nullptr);
 	TEST_CHECK(instances == 0);
 }
 
+void test_ObjectPool()
+{
+	// Freed blocks are reused for the same size class
+	UserInstance *ui = new UserInstance(UserIdBasic("Pool"));
+	void *first = ui;
+	delete ui;
+	ui = new UserInstance(UserIdBasic("Pool"));
+	TEST_CHECK((void *)ui == first);
+	delete ui;
+
+	void *a = ObjectPool::allocate(40);
+	void *b = ObjectPool::allocate(33);
+	TEST_CHECK(a != b && ((size_t)a % 16) == 0 && ((size_t)b % 16) == 0);
+	ObjectPool::release(a, 40);
+	TEST_CHECK(ObjectPool::allocate(48) == a);
+	ObjectPool::release(a, 48);
+	ObjectPool::release(b, 33);
+
+	// Large objects are passed to the heap
+	size_t reserved = ObjectPool::getReservedBytes();
+	void *big = ObjectPool::allocate(4096);
+	ObjectPool::release(big, 4096);
+	TEST_CHECK(ObjectPool::getReservedBytes() == reserved);
+}
+
 void test_Channel(Unittest *ut)
 {
+	TEST_REGISTER(test_ObjectPool)
 	TEST_REGISTER(test_Client_setup)
 	TEST_REGISTER(test_Network_Channel_UserInstance)
 	TEST_REGISTER(test_Client_cleanup)
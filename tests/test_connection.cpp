@@ -1,8 +1,117 @@
 #include "test.h"
 #include "connection.h"
+#include "http_engine.h"
 #include "logger.h"
+#include "wake_event.h"
+#include "websocket.h"
 #include <memory>
 #include <picojson.h>
+#include <string.h>
+
+static void linebuffer_write(LineBuffer &buf, const char *text)
+{
+	size_t size;
+	char *dst = buf.prepareWrite(&size);
+	size_t len = strlen(text);
+	TEST_CHECK(size >= len);
+	memcpy(dst, text, len);
+	buf.commitWrite(len);
+}
+
+void test_Connection_LineBuffer()
+{
+	LineBuffer buf(16, 64);
+	std::string_view line;
+
+	linebuffer_write(buf, "foo\r\n\nbar");
+	TEST_CHECK(buf.popLine(&line) && line == "foo");
+	TEST_CHECK(buf.popLine(&line) == false);
+
+	linebuffer_write(buf, " baz\n");
+	TEST_CHECK(buf.popLine(&line) && line == "bar baz");
+	TEST_CHECK(buf.popLine(&line) == false);
+
+	// Buffer grows for long lines
+	linebuffer_write(buf, "0123456789ABCDEF");
+	linebuffer_write(buf, "0123456789\n");
+	TEST_CHECK(buf.capacity() > 16);
+	TEST_CHECK(buf.popLine(&line) && line.size() == 26);
+
+	// Oversized lines are dropped up to and including the next '\n'
+	LineBuffer small(16, 32);
+	linebuffer_write(small, "0123456789ABCDEF");
+	linebuffer_write(small, "0123456789ABCDEF");
+	TEST_CHECK(small.popLine(&line) == false);
+	linebuffer_write(small, "QUIT :inje");
+	TEST_CHECK(small.popLine(&line) == false);
+	linebuffer_write(small, "cted\r\nPING x\n");
+	TEST_CHECK(small.popLine(&line) && line == "PING x");
+	TEST_CHECK(small.popLine(&line) == false);
+}
+
+void test_Connection_PacketQueue()
+{
+	PacketQueue q(3, 10);
+	TEST_CHECK(q.push("hello"));
+	TEST_CHECK(q.push("world"));
+	// Byte limit
+	TEST_CHECK(q.push("!") == false);
+
+	std::string out;
+	TEST_CHECK(q.pop(out) && out == "hello");
+	TEST_CHECK(q.push("foo"));
+	TEST_CHECK(q.push("bar") == false);
+	q.setMaxBytes(100);
+	TEST_CHECK(q.push("bar"));
+	// Packet limit (rounded up to 4)
+	TEST_CHECK(q.push("baz"));
+	TEST_CHECK(q.push("!") == false);
+
+	std::vector<std::string> batch;
+	TEST_CHECK(q.popBatch(batch) == 4);
+	TEST_CHECK(batch.size() == 4 && batch[2] == "bar");
+	TEST_CHECK(q.empty() && q.getBytes() == 0);
+	TEST_CHECK(q.getHighWaterMark() == 14);
+}
+
+static void websocket_write(WebSocketCodec &codec, std::string_view data)
+{
+	size_t size;
+	char *dst = codec.prepareWrite(&size);
+	TEST_CHECK(size >= data.size());
+	memcpy(dst, data.data(), data.size());
+	codec.commitWrite(data.size());
+}
+
+void test_Connection_WebSocket()
+{
+	WebSocketCodec codec(16, 1024);
+	WebSocketFrame msg;
+
+	// Masked frame, larger than the initial buffer
+	std::string frame, text(200, 'x');
+	WebSocketCodec::encodeFrame(WebSocketFrame::OP_TEXT, text, &frame);
+	TEST_CHECK(frame.size() == 200 + 4 + 4);
+	websocket_write(codec, std::string_view(frame).substr(0, 10));
+	TEST_CHECK(codec.popMessage(&msg) == false);
+	websocket_write(codec, std::string_view(frame).substr(10));
+	TEST_CHECK(codec.popMessage(&msg));
+	TEST_CHECK(msg.opcode == WebSocketFrame::OP_TEXT && msg.payload == text);
+
+	// Fragmented message with a ping in between (unmasked server frames)
+	websocket_write(codec, std::string_view("\x01\x03" "foo" "\x89\x01!" "\x80\x03" "bar", 13));
+	TEST_CHECK(codec.popMessage(&msg));
+	TEST_CHECK(msg.opcode == WebSocketFrame::OP_PING && msg.payload == "!");
+	TEST_CHECK(codec.popMessage(&msg));
+	TEST_CHECK(msg.opcode == WebSocketFrame::OP_TEXT && msg.payload == "foobar");
+	TEST_CHECK(codec.popMessage(&msg) == false);
+	TEST_CHECK(!codec.hasError());
+
+	// Continuation without start
+	websocket_write(codec, std::string_view("\x80\x00", 2));
+	TEST_CHECK(codec.popMessage(&msg) == false);
+	TEST_CHECK(codec.hasError());
+}
 
 void test_Connection_Stream()
 {
@@ -13,15 +122,11 @@ void test_Connection_Stream()
 	std::string what("GET / HTTP/1.0\r\nHost: example.com\r\n\r\n");
 	con->send(what);
 
-	std::string *first = nullptr;
-	while (!first) {
+	std::string first;
+	while (!con->popRecv(first))
 		sleep_ms(100);
-		first = con->popRecv();
-	}
-
-	TEST_CHECK(first->rfind("HTTP/1.0 200 OK") != std::string::npos);
 
-	delete first;
+	TEST_CHECK(first.rfind("HTTP/1.0 200 OK") != std::string::npos);
 }
 
 void test_Connection_HTTP_GET()
@@ -29,15 +134,42 @@ void test_Connection_HTTP_GET()
 	std::unique_ptr<Connection> con(Connection::createHTTP("GET", "https://example.com"));
 	con->connect();
 
-	std::string *first = nullptr;
-	while (!first) {
+	std::string first;
+	while (!con->popRecv(first))
 		sleep_ms(100);
-		first = con->popRecv();
-	}
 
-	TEST_CHECK(first->rfind("<!doctype html>") != std::string::npos);
+	TEST_CHECK(first.rfind("<!doctype html>") != std::string::npos);
+}
 
-	delete first;
+void test_Connection_HTTPEngine()
+{
+	WakeEvent wake;
+	HTTPEngine engine(&wake);
+	int owner_a, owner_b;
+	int done = 0;
+
+	for (int i = 0; i < 3; ++i) {
+		engine.enqueue(&owner_a, Connection::createHTTP("GET", "https://example.com"),
+			[&done] (Connection *con, bool ok) {
+				std::string body;
+				TEST_CHECK(ok && con->popRecv(body));
+				TEST_CHECK(body.rfind("<!doctype html>") != std::string::npos);
+				done++;
+			}
+		);
+	}
+	engine.enqueue(&owner_b, Connection::createHTTP("GET", "https://example.com"),
+		[] (Connection *con, bool ok) {
+			TEST_CHECK(!"Cancelled request must not finish");
+		}
+	);
+	engine.cancel(&owner_b);
+
+	for (int i = 0; i < 100 && engine.getPending() > 0; ++i) {
+		wake.wait(0.1f);
+		engine.processDone();
+	}
+	TEST_CHECK(done == 3);
 }
 
 void test_Connection_HTTP_REST()
@@ -75,7 +207,11 @@ void test_Connection_HTTP_REST()
 
 void test_Connection(Unittest *ut)
 {
+	TEST_REGISTER(test_Connection_LineBuffer)
+	TEST_REGISTER(test_Connection_PacketQueue)
+	TEST_REGISTER(test_Connection_WebSocket)
 	TEST_REGISTER(test_Connection_Stream)
 	TEST_REGISTER(test_Connection_HTTP_GET)
+	TEST_REGISTER(test_Connection_HTTPEngine)
 	TEST_REGISTER(test_Connection_HTTP_REST)
 }
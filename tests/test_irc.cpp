@@ -0,0 +1,94 @@
+#include "test.h"
+#include "../client/irc_message.h"
+#include "../client/irc_sendqueue.h"
+
+void test_IRC_SendQueue()
+{
+	IRCSendQueue q;
+	q.setRate(2, 1);
+
+	auto time = std::chrono::high_resolution_clock::now() + std::chrono::seconds(10);
+	std::string line;
+
+	q.push(SP_BULK, "", "bulk");
+	q.push(SP_REPLY, "#a", "a1");
+	q.push(SP_REPLY, "#a", "a2");
+	q.push(SP_REPLY, "#b", "b1");
+	q.push(SP_URGENT, "", "urgent");
+	TEST_CHECK(q.size() == 5);
+
+	// Priority first, then round-robin
+	TEST_CHECK(q.pop(time, &line) && line == "urgent");
+	TEST_CHECK(q.pop(time, &line) && line == "a1");
+	// Burst is used up
+	TEST_CHECK(q.pop(time, &line) == false);
+	TEST_CHECK(q.getDelay(time) > 0.9f);
+
+	time += std::chrono::seconds(1);
+	TEST_CHECK(q.getDelay(time) == 0.0f);
+	TEST_CHECK(q.pop(time, &line) && line == "b1");
+
+	time += std::chrono::seconds(5);
+	TEST_CHECK(q.pop(time, &line) && line == "a2");
+	TEST_CHECK(q.pop(time, &line) && line == "bulk");
+	TEST_CHECK(q.getDelay(time) < 0.0f);
+
+	// Long lines cost more, but at most the whole burst
+	q.setRate(3, 1);
+	q.push(SP_BULK, "", std::string(250, 'x'));
+	q.push(SP_BULK, "", std::string(1000, 'y'));
+	time += std::chrono::seconds(5);
+	TEST_CHECK(q.pop(time, &line) && line[0] == 'x');
+	TEST_CHECK(q.pop(time, &line) == false);
+	TEST_CHECK(q.getDelay(time) > 2.9f);
+	time += std::chrono::seconds(3);
+	TEST_CHECK(q.pop(time, &line) && line[0] == 'y');
+}
+
+void test_IRC_Message()
+{
+	IRCMessage msg;
+
+	TEST_CHECK(msg.parse(":nick!user@host PRIVMSG #chan :hello  world\r\n"));
+	TEST_CHECK(msg.nickname == "nick" && msg.hostmask == "user@host");
+	TEST_CHECK(msg.command == "PRIVMSG");
+	TEST_CHECK(msg.num_params == 2 && msg.param(0) == "#chan");
+	TEST_CHECK(msg.text() == "hello  world");
+	TEST_CHECK(msg.param(2).empty());
+
+	// Views point into the line
+	std::string line("PING irc.example.net");
+	TEST_CHECK(msg.parse(line));
+	TEST_CHECK(msg.prefix.empty() && msg.command == "PING");
+	TEST_CHECK(msg.text().data() == line.data() + 5);
+
+	// Server prefix, no trailing ':'
+	TEST_CHECK(msg.parse(":irc.example.net 353 bot = #chan :@op voice"));
+	TEST_CHECK(msg.nickname.empty() && msg.hostmask == "irc.example.net");
+	TEST_CHECK(msg.param(2) == "#chan" && msg.text() == "@op voice");
+	TEST_CHECK(msg.parse(":a!b@c JOIN #chan"));
+	TEST_CHECK(msg.num_params == 1 && msg.param(0) == "#chan");
+
+	// IRCv3 message tags
+	TEST_CHECK(msg.parse("@time=2023-01-01T00:00:00.000Z;+draft/typing;id=a\\sb :n!u@h PRIVMSG #c :hi"));
+	std::string_view value;
+	TEST_CHECK(msg.getTag("time", &value) && value == "2023-01-01T00:00:00.000Z");
+	TEST_CHECK(msg.getTag("+draft/typing", &value) && value.empty());
+	TEST_CHECK(msg.getTag("id", &value) && value == "a\\sb");
+	TEST_CHECK(!msg.getTag("account"));
+	TEST_CHECK(msg.nickname == "n" && msg.text() == "hi");
+
+	// Parameter limit: the rest is kept in the last one
+	TEST_CHECK(msg.parse("CMD 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16"));
+	TEST_CHECK(msg.num_params == IRCMessage::MAX_PARAMS);
+	TEST_CHECK(msg.text() == "15 16");
+
+	TEST_CHECK(!msg.parse(""));
+	TEST_CHECK(!msg.parse(":prefix.only"));
+}
+
+void test_IRC(Unittest *ut)
+{
+	TEST_REGISTER(test_IRC_Message)
+	TEST_REGISTER(test_IRC_SendQueue)
+}
@@ -50,6 +50,47 @@ void test_Module_Container()
 
 		dc = (DemoContainer *)c.get(nullptr);
 		TEST_CHECK(dc != nullptr && dc->dump() == "55");
+
+		ContainerOwner *tmp = new ContainerOwner();
+		c.set(tmp, new DemoContainer(22));
+		TEST_CHECK(c.move(tmp, &ref) == true);
+		TEST_CHECK(c.get(tmp) == nullptr && c.size() == 2);
+
+		// Recycled slot must not expose data of the destructed owner
+		c.set(tmp, new DemoContainer(33));
+		size_t slot = tmp->getContainerSlot();
+		delete tmp;
+		ContainerOwner reused;
+		TEST_CHECK(reused.getContainerSlot() == slot);
+		TEST_CHECK(c.get(&reused) == nullptr);
+		c.set(&reused, new DemoContainer(44));
+		TEST_CHECK(instances == 3 && c.size() == 3);
+
+		// Module reload: move away from a destructed owner
+		alignas(ContainerOwner) char storage[sizeof(ContainerOwner)];
+		ContainerOwner *expired = new (storage) ContainerOwner();
+		c.set(expired, new DemoContainer(66));
+		size_t old_slot = expired->reserveContainerSlot();
+		expired->~ContainerOwner();
+		ContainerOwner *successor = new ContainerOwner();
+		TEST_CHECK(successor->getContainerSlot() != old_slot);
+		TEST_CHECK(c.move(old_slot, successor) == true);
+		ContainerOwner::releaseContainerSlot(old_slot);
+		dc = (DemoContainer *)c.get(successor);
+		TEST_CHECK(dc != nullptr && dc->num == 66);
+		TEST_CHECK(instances == 4 && c.size() == 4);
+		c.remove(successor);
+		delete successor;
+
+		// Same address and recycled slot: still a different owner
+		ContainerOwner *first = new (storage) ContainerOwner();
+		c.set(first, new DemoContainer(77));
+		slot = first->getContainerSlot();
+		first->~ContainerOwner();
+		ContainerOwner *second = new (storage) ContainerOwner();
+		TEST_CHECK(second == first && second->getContainerSlot() == slot);
+		TEST_CHECK(c.get(second) == nullptr);
+		second->~ContainerOwner();
 	}
 
 	TEST_CHECK(instances == 0);
@@ -1,4 +1,5 @@
 #include "test.h"
+#include "../core/json_reader.h"
 #include "../core/utils.h"
 
 void test_Utils_strops()
@@ -49,9 +50,74 @@ void test_Utils_base64()
 	TEST_CHECK(base64decode(&data2[0], data2.size()) == data1);
 }
 
+void test_Utils_sha1()
+{
+	// RFC 6455, section 1.3
+	std::string key("dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+	std::string digest(sha1(key.c_str(), key.size()));
+	TEST_CHECK(base64encode(digest.c_str(), digest.size()) == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+
+	// Two padding blocks
+	std::string text(60, 'a');
+	digest = sha1(text.c_str(), text.size());
+	TEST_CHECK(base64encode(digest.c_str(), digest.size()) == "E9lWAz2a9Em/4sTveMF8IEacS/E=");
+}
+
+void test_Utils_JsonReader()
+{
+	std::string doc(R"({ "ok" : true, "result": [
+		{ "id": -1234567890123, "name": "a\"b\u00e4\ud83d\ude00", "skip": { "x": [1, {}, [] ] } },
+		{ "id": 5.5, "name": null }
+	], "extra": "x" })");
+
+	JsonReader r(doc);
+	bool ok = false;
+	int num_elements = 0;
+	int64_t ids[2] = {};
+	std::string name;
+
+	bool success = r.forEachMember([&] (std::string_view key) {
+		if (key == "ok")
+			return r.readBool(&ok);
+		if (key == "result") {
+			return r.forEachElement([&] () {
+				int64_t *id = &ids[num_elements++];
+				return r.forEachMember([&] (std::string_view key) {
+					if (key == "id")
+						r.readInt(id);
+					else if (key == "name")
+						r.readString(&name); // null: unchanged
+					else
+						r.skipValue();
+					return !r.hasError();
+				});
+			});
+		}
+		return r.skipValue();
+	});
+	TEST_CHECK(success && ok);
+	TEST_CHECK(r.next() == JsonReader::JT_END);
+	TEST_CHECK(num_elements == 2);
+	TEST_CHECK(ids[0] == -1234567890123LL && ids[1] == 5);
+	TEST_CHECK(name == "a\"b\u00e4\U0001F600");
+
+	// Syntax errors
+	const char *invalid[] = {
+		"{", "[1, 2}", "[1, ]", "[1 2]", R"({"a" 1})", R"({"a": tru})", R"("\u12")", "1 2"
+	};
+	for (const char *text : invalid) {
+		JsonReader r(text);
+		while (r.next() > JsonReader::JT_END)
+			;
+		TEST_CHECK(r.hasError());
+	}
+}
+
 void test_Utils(Unittest *ut)
 {
 	TEST_REGISTER(test_Utils_strops)
 	TEST_REGISTER(test_Utils_irc_stuff)
 	TEST_REGISTER(test_Utils_base64)
+	TEST_REGISTER(test_Utils_sha1)
+	TEST_REGISTER(test_Utils_JsonReader)
 }